@@ -1 +1,2 @@
 gcc -O3 ./src/main.c -lraylib -lGL -lm -lpthread -ldl -lrt -march=native -o game.out
+gcc -O3 -I./include ./src/headless.c -lm -lpthread -march=native -o headless.out
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Runs headless.out (see build.sh) in --deterministic mode with 1, 4 and 8 threads for every
+# solver and fails if the state hashes differ. Extra arguments go to every run.
+status=0
+for mode in "" --jacobi --task-graph; do
+    expected=""
+    for threads in 1 4 8; do
+        hash=$(./headless.out --deterministic --steps 200 --threads $threads $mode "$@" |
+               sed -n 's/^State hash: //p')
+        echo "${mode:-default} $threads threads: $hash"
+        if [ -z "$hash" ]; then
+            status=1
+        elif [ -z "$expected" ]; then
+            expected=$hash
+        elif [ "$hash" != "$expected" ]; then
+            echo "  differs from $expected"
+            status=1
+        fi
+    done
+done
+exit $status
@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "./include/bench.h"
+#include "./include/globals.h"
+#include "./include/render.h"
+#include "./include/sim.h"
+#include "./include/types.h"
+
+// Frames drawn before measuring, so buffers are allocated and drivers warmed up
+#define BENCH_WARMUP 10
+
+static const u32 benchCounts[] = {16384, 40960, 81920, 163840};
+static const float benchZooms[] = {0.5f, 1.0f, 1.5f};
+
+int compareSeconds(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(const double *sorted, u32 count, double q) {
+    return sorted[(u32)((count - 1) * q + 0.5)];
+}
+
+// Draws `frames` frames of a frozen set and prints, in ms, the percentiles of the whole frame
+// (swap included, where a software driver does its rasterizing) and the median of the world
+// pass alone, along with both per particle drawn
+void benchmarkFrames(Camera2D camera, u32 frames, double *frameSeconds, double *passSeconds) {
+    u32 drawn = 0;
+    for (u32 f = 0; f < BENCH_WARMUP + frames; f++) {
+        double start = GetTime();
+        BeginDrawing();
+        ClearBackground(RAYWHITE);
+        BeginMode2D(camera);
+        double passStart = GetTime();
+        drawn = drawParticles(camera);
+        rlDrawRenderBatchActive();
+        double passEnd = GetTime();
+        EndMode2D();
+        EndDrawing();
+        double end = GetTime();
+
+        if (f < BENCH_WARMUP) continue;
+        frameSeconds[f - BENCH_WARMUP] = end - start;
+        passSeconds[f - BENCH_WARMUP] = passEnd - passStart;
+    }
+
+    qsort(frameSeconds, frames, sizeof(double), compareSeconds);
+    qsort(passSeconds, frames, sizeof(double), compareSeconds);
+    double frame = percentile(frameSeconds, frames, 0.5);
+    double pass = percentile(passSeconds, frames, 0.5);
+    printf("%6.2f %8u %8.3f %8.3f %8.3f %8.3f %10.1f %10.1f\n", camera.zoom, drawn, pass * 1000,
+           frame * 1000, percentile(frameSeconds, frames, 0.95) * 1000,
+           percentile(frameSeconds, frames, 0.99) * 1000, drawn ? pass * 1e9 / drawn : 0,
+           drawn ? frame * 1e9 / drawn : 0);
+}
+
+// World pass of every render mode over a frozen set of particles (spawned from DEFAULT_SEED and
+// binned once, never stepped) at several counts and zooms. The density LOD is turned off so the
+// particles are always drawn, and the frame rate is not capped.
+void benchmarkRender(Texture2D circle, u32 frames) {
+    double *frameSeconds = (double *)malloc(frames * sizeof(double));
+    double *passSeconds = (double *)malloc(frames * sizeof(double));
+    if (!frameSeconds || !passSeconds) {
+        printf("Failed to allocate the timings of %u frames\n", frames);
+        free(frameSeconds);
+        free(passSeconds);
+        return;
+    }
+    SetTargetFPS(0);
+
+    for (int m = 0; m < RENDER_MODES; m++) {
+        renderer.mode = m;
+        renderer.lod = false;
+        initRenderer(circle, colors);
+        if (renderer.mode != m) {
+            closeRenderer();
+            continue;
+        }
+
+        for (u32 c = 0; c < sizeof(benchCounts) / sizeof(benchCounts[0]); c++) {
+            clearPoints();
+            SetRandomSeed(DEFAULT_SEED);
+            spawnPoints(benchCounts[c]);
+            updatePartitions();
+
+            printf("\n%s, %u particles, %u frames at %dx%d\n", renderModeNames[m], pts.amount,
+                   frames, w, h);
+            printf("%6s %8s %8s %8s %8s %8s %10s %10s\n", "zoom", "drawn", "pass", "p50", "p95",
+                   "p99", "pass ns/p", "frame ns/p");
+            for (u32 z = 0; z < sizeof(benchZooms) / sizeof(benchZooms[0]); z++) {
+                Camera2D camera = {.offset = {w / 2.0f, h / 2.0f}, .zoom = benchZooms[z]};
+                benchmarkFrames(camera, frames, frameSeconds, passSeconds);
+            }
+        }
+        closeRenderer();
+    }
+
+    free(frameSeconds);
+    free(passSeconds);
+}
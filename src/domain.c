@@ -0,0 +1,276 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "./include/domain.h"
+#include "./include/globals.h"
+#include "./include/jobs.h"
+#include "./include/memory.h"
+#include "./include/points.h"
+#include "./include/sim.h"
+
+double domainClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool ringPush(ParticleRing *ring, ParticleRecord *record) {
+    u64 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_RECORDS) {
+        return false;
+    }
+
+    ring->records[tail % RING_RECORDS] = *record;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool ringPop(ParticleRing *ring, ParticleRecord *record) {
+    u64 head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) return false;
+
+    *record = ring->records[head % RING_RECORDS];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+void growRecords(ParticleRecord **records, u32 *capacity, u32 needed) {
+    if (needed <= *capacity) return;
+
+    *capacity = needed * 2;
+    *records = (ParticleRecord *)realloc(*records, *capacity * sizeof(ParticleRecord));
+}
+
+void queueRecord(Domain *domain, int side, u32 p, u8 kind) {
+    if (!domain->out[side]) return;
+
+    u32 at = domain->outCount[side]++;
+    growRecords(&domain->outbox[side], &domain->outCapacity[side], domain->outCount[side]);
+    domain->outbox[side][at] = (ParticleRecord){
+        getPositionX(p), getPositionY(p), getSpeedX(p), getSpeedY(p),
+        getRadius(p),    0,               pts.colors[p], kind,
+    };
+}
+
+void appendRecord(ParticleRecord *record) {
+    reservePoints(pts.amount + 1);
+
+    u32 p = pts.amount++;
+    setPositionX(p, record->positionX), setPositionY(p, record->positionY);
+    setSpeedX(p, record->speedX), setSpeedY(p, record->speedY);
+    setRadius(p, record->radius), pts.colors[p] = record->color;
+}
+
+void removeOwnedPoint(u32 p) {
+    u32 last = --pts.amount;
+#define X(type, name) copyPoint(pts.name, p, pts.name, last);
+    POINTS_STREAMS(X)
+#undef X
+}
+
+// Sends both outboxes and receives from both neighbours until each side has seen the END record
+// of this step. Both directions make progress in the same loop, so two processes pushing to each
+// other through full rings can not deadlock.
+void exchangeRecords(Domain *domain, u32 step) {
+    ParticleRecord end = {.step = step, .kind = RECORD_END};
+    u32 sent[2] = {0, 0};
+    bool sentAll[2], receivedAll[2];
+    for (int side = 0; side < 2; side++) {
+        sentAll[side] = !domain->out[side];
+        receivedAll[side] = !domain->in[side];
+    }
+
+    domain->inCount = 0;
+    while (!sentAll[0] || !sentAll[1] || !receivedAll[0] || !receivedAll[1]) {
+        bool progress = false;
+
+        for (int side = 0; side < 2; side++) {
+            while (!sentAll[side]) {
+                bool last = sent[side] == domain->outCount[side];
+                ParticleRecord *record = last ? &end : &domain->outbox[side][sent[side]];
+                if (!ringPush(domain->out[side], record)) break;
+
+                progress = true;
+                if (last) sentAll[side] = true;
+                else sent[side]++;
+            }
+
+            ParticleRecord record;
+            while (!receivedAll[side] && ringPop(domain->in[side], &record)) {
+                progress = true;
+                if (record.kind == RECORD_END) {
+                    receivedAll[side] = true;
+                    continue;
+                }
+
+                growRecords(&domain->inbox, &domain->inCapacity, domain->inCount + 1);
+                domain->inbox[domain->inCount++] = record;
+            }
+        }
+
+        if (!progress) sched_yield();
+    }
+}
+
+// One step of a slab:
+//  - particles that left the slab migrate to the neighbour, the ones near a border are sent as
+//    read-only halo copies so that contacts across the border are seen from both sides
+//  - halos are appended after the owned particles, collide like any other particle, and are
+//    dropped again before integrating
+void stepDomain(Domain *domain, u32 step) {
+    beginFrame();
+    domain->outCount[0] = domain->outCount[1] = 0;
+
+    u32 migrated = 0;
+    for (u32 p = 0; p < pts.amount;) {
+        float x = getPositionX(p);
+        int side = x < domain->slabMin ? 0 : (x >= domain->slabMax ? 1 : -1);
+        if (side < 0 || !domain->out[side]) {
+            p++;
+            continue;
+        }
+
+        queueRecord(domain, side, p, RECORD_MIGRANT);
+        removeOwnedPoint(p);
+        migrated++;
+    }
+
+    for (u32 p = 0; p < pts.amount; p++) {
+        float x = getPositionX(p);
+        if (x < domain->slabMin + PARTITION_SIZE) queueRecord(domain, 0, p, RECORD_HALO);
+        if (x >= domain->slabMax - PARTITION_SIZE) queueRecord(domain, 1, p, RECORD_HALO);
+    }
+
+    exchangeRecords(domain, step);
+
+    for (u32 r = 0; r < domain->inCount; r++) {
+        if (domain->inbox[r].kind == RECORD_MIGRANT) appendRecord(&domain->inbox[r]);
+    }
+    u32 owned = pts.amount;
+    for (u32 r = 0; r < domain->inCount; r++) {
+        if (domain->inbox[r].kind == RECORD_HALO) appendRecord(&domain->inbox[r]);
+    }
+    padPoints();
+
+    updatePartitions();
+    solveCollisions();
+
+    pts.amount = owned;
+    padPoints();
+    pointsVersion++;
+    updatePositions();
+
+    atomic_fetch_add(&domain->shared->migrated[domain->rank], migrated);
+}
+
+void spawnSlabPoints(Domain *domain, u32 count) {
+    reservePoints(pts.amount + count);
+    for (u32 i = 0; i < count; i++) {
+        u8 r = BASE_SIZE + GetRandomValue(3, 4);
+        u32 p = pts.amount++;
+
+        setPositionX(p, GetRandomValue(domain->slabMin + r, domain->slabMax - r));
+        setPositionY(p, GetRandomValue(-worldSize.y / 2 + r, worldSize.y / 2 - r));
+
+        setSpeedX(p, GetRandomValue(-MAX_SPEED, MAX_SPEED));
+        setSpeedY(p, GetRandomValue(-MAX_SPEED, MAX_SPEED));
+
+        setRadius(p, r);
+        pts.colors[p] = GetRandomValue(0, PALETTE_SIZE - 1);
+    }
+    padPoints();
+    pointsVersion++;
+}
+
+void runSlab(DomainShared *shared, u32 rank, u32 procs, u32 steps, u32 points) {
+    Domain domain = {.rank = rank, .shared = shared};
+    float slabWidth = worldSize.x / procs;
+    domain.slabMin = -worldSize.x / 2 + slabWidth * rank;
+    domain.slabMax = domain.slabMin + slabWidth;
+
+    domain.out[0] = rank > 0 ? &shared->toLeft[rank - 1] : 0;
+    domain.in[0] = rank > 0 ? &shared->toRight[rank - 1] : 0;
+    domain.out[1] = rank + 1 < procs ? &shared->toRight[rank] : 0;
+    domain.in[1] = rank + 1 < procs ? &shared->toLeft[rank] : 0;
+
+    // The grid only needs this slab's columns plus one column of halo on each side
+    columnsBegin = (domain.slabMin + worldSize.x / 2) / PARTITION_SIZE - 1;
+    columnsEnd = (domain.slabMax + worldSize.x / 2) / PARTITION_SIZE + 1;
+    if (columnsBegin < 0) columnsBegin = 0;
+    if (columnsEnd > partitionsX) columnsEnd = partitionsX;
+
+    initJobs(numThreads);
+    SetRandomSeed(DEFAULT_SEED + rank);
+    spawnSlabPoints(&domain, points / procs);
+
+    // Start the clock once every process is ready
+    atomic_fetch_add(&shared->started, 1);
+    while (atomic_load(&shared->started) < procs) sched_yield();
+
+    double start = domainClock();
+    for (u32 step = 0; step < steps; step++) stepDomain(&domain, step);
+    double seconds = domainClock() - start;
+
+    shared->seconds[rank] = seconds;
+    atomic_store(&shared->owned[rank], pts.amount);
+    if (rank == 0) reportMemory();
+    shutdownJobs();
+}
+
+// Runs the simulation split in `procs` slabs, one process each, for a fixed number of steps and
+// prints how the particles ended up spread. Rank 0 is this process, the others are forked.
+int runDomains(u32 procs, u32 steps, u32 points) {
+    if (procs > MAX_PROCS) procs = MAX_PROCS;
+    dt = 1.0f / TARGET_FPS;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/imgui-test-domains-%d", getpid());
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(DomainShared)) != 0) {
+        perror("shm_open");
+        return 1;
+    }
+
+    DomainShared *shared = (DomainShared *)mmap(0, sizeof(DomainShared), PROT_READ | PROT_WRITE,
+                                                MAP_SHARED, fd, 0);
+    close(fd);
+    shm_unlink(name);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    shared->procs = procs;
+
+    pid_t children[MAX_PROCS];
+    for (u32 rank = 1; rank < procs; rank++) {
+        children[rank] = fork();
+        if (children[rank] == 0) {
+            runSlab(shared, rank, procs, steps, points);
+            _exit(0);
+        }
+    }
+
+    runSlab(shared, 0, procs, steps, points);
+    for (u32 rank = 1; rank < procs; rank++) waitpid(children[rank], 0, 0);
+
+    u64 total = 0, migrated = 0;
+    double slowest = 0;
+    for (u32 rank = 0; rank < procs; rank++) {
+        u64 owned = atomic_load(&shared->owned[rank]);
+        u64 moved = atomic_load(&shared->migrated[rank]);
+        printf(" - slab %u: %lu particles, %lu migrated out, %.2fs\n", rank, owned, moved,
+               shared->seconds[rank]);
+        total += owned, migrated += moved;
+        if (shared->seconds[rank] > slowest) slowest = shared->seconds[rank];
+    }
+
+    printf("%u slabs, %lu particles, %u steps in %.2fs (%.0f particle steps/s), %lu migrations\n",
+           procs, total, steps, slowest, total * steps / slowest, migrated);
+
+    munmap(shared, sizeof(DomainShared));
+    return 0;
+}
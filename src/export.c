@@ -0,0 +1,144 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "./include/export.h"
+#include "./include/memory.h"
+#include "./include/raster.h"
+#include "./include/types.h"
+
+// Frames go through a ring of EXPORT_SLOTS canvases. The render loop fills the slot after the
+// last published one and publishes it, the writer thread encodes and writes the published slots
+// in order. When every slot is still waiting for the disk the render loop drops its frame
+// instead of waiting, the lock is never held across I/O.
+struct {
+    FILE *file;
+    const char *path;
+    ExportFormat format;
+    Canvas slots[EXPORT_SLOTS];
+    // Y, U and V planes of the frame being written
+    u8 *planes;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t published;
+    u64 head; // frames published
+    u64 tail; // frames written
+    bool quit;
+    bool failed;
+
+    u64 dropped;
+    double writeSeconds;
+} typedef Exporter;
+
+static Exporter exporter;
+
+// RGBA8 to 4:4:4 Y'CbCr, BT.601 limited range in 8 bit fixed point
+void writeY4mFrame(FILE *file, const Canvas *frame) {
+    u64 size = (u64)frame->width * frame->height;
+    u8 *y = exporter.planes, *u = y + size, *v = u + size;
+    for (u64 i = 0; i < size; i++) {
+        int r = frame->pixels[i] & 0xff, g = frame->pixels[i] >> 8 & 0xff,
+            b = frame->pixels[i] >> 16 & 0xff;
+        y[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        u[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        v[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+
+    fputs("FRAME\n", file);
+    fwrite(exporter.planes, 3, size, file);
+}
+
+void *exportWriter(void *arg) {
+    pthread_mutex_lock(&exporter.lock);
+    while (true) {
+        while (exporter.tail == exporter.head && !exporter.quit) {
+            pthread_cond_wait(&exporter.published, &exporter.lock);
+        }
+        // Quitting only once everything published is written
+        if (exporter.tail == exporter.head) break;
+
+        Canvas *frame = &exporter.slots[exporter.tail % EXPORT_SLOTS];
+        pthread_mutex_unlock(&exporter.lock);
+
+        double start = GetTime();
+        bool failed = false;
+        if (exporter.format == EXPORT_Y4M) {
+            writeY4mFrame(exporter.file, frame);
+        } else {
+            failed = !writePpmImage(exporter.file, frame);
+        }
+        failed |= ferror(exporter.file);
+        double seconds = GetTime() - start;
+
+        pthread_mutex_lock(&exporter.lock);
+        exporter.tail++;
+        exporter.writeSeconds += seconds;
+        exporter.failed |= failed;
+    }
+    pthread_mutex_unlock(&exporter.lock);
+    return 0;
+}
+
+// Opens the stream and starts its writer, every frame of the run must be width x height
+bool startExport(const char *path, int width, int height, u32 fps) {
+    const char *extension = strrchr(path, '.');
+    exporter.format = extension && !strcmp(extension, ".y4m") ? EXPORT_Y4M : EXPORT_PPM;
+    exporter.path = path;
+    exporter.file = fopen(path, "wb");
+    if (!exporter.file) {
+        perror(path);
+        return false;
+    }
+
+    u64 size = (u64)width * height;
+    Arena *arena = NewArena(size * 4 * EXPORT_SLOTS + size * 3 + KB(4), TAG_RENDER);
+    for (u32 s = 0; s < EXPORT_SLOTS; s++) {
+        exporter.slots[s] = (Canvas){(u32 *)alloc(arena, 32, size * 4), width, height};
+    }
+    if (exporter.format == EXPORT_Y4M) {
+        exporter.planes = alloc(arena, 32, size * 3);
+        fprintf(exporter.file, "YUV4MPEG2 W%d H%d F%u:1 Ip A1:1 C444\n", width, height, fps);
+    }
+
+    pthread_mutex_init(&exporter.lock, 0);
+    pthread_cond_init(&exporter.published, 0);
+    pthread_create(&exporter.writer, 0, exportWriter, 0);
+    return true;
+}
+
+// Canvas to draw the next frame into, 0 when the writer is behind and the frame is dropped
+Canvas *exportSlot() {
+    pthread_mutex_lock(&exporter.lock);
+    bool full = exporter.head - exporter.tail == EXPORT_SLOTS;
+    pthread_mutex_unlock(&exporter.lock);
+
+    if (full) {
+        exporter.dropped++;
+        return 0;
+    }
+    return &exporter.slots[exporter.head % EXPORT_SLOTS];
+}
+
+// Hands the slot returned by exportSlot() to the writer
+void publishExportSlot() {
+    pthread_mutex_lock(&exporter.lock);
+    exporter.head++;
+    pthread_cond_signal(&exporter.published);
+    pthread_mutex_unlock(&exporter.lock);
+}
+
+// Waits for the published frames to be written and closes the stream
+void finishExport() {
+    pthread_mutex_lock(&exporter.lock);
+    exporter.quit = true;
+    pthread_cond_signal(&exporter.published);
+    pthread_mutex_unlock(&exporter.lock);
+    pthread_join(exporter.writer, 0);
+
+    bool closed = !fclose(exporter.file);
+    printf("Exported %lu frames to %s (%lu dropped), %.3fms per frame written%s\n",
+            exporter.tail, exporter.path, exporter.dropped,
+            exporter.tail ? exporter.writeSeconds * 1000 / exporter.tail : 0,
+            exporter.failed || !closed ? ", write failed" : "");
+}
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+
+// Only the types of raylib are used, this entry point does not link it
+#include "raylib.h"
+
+#include "./include/jobs.h"
+#include "./include/export.h"
+#include "./include/memory.h"
+#include "./include/points.h"
+#include "./include/raster.h"
+#include "./include/types.h"
+
+#include "./include/globals.h"
+#include "./include/sim.h"
+
+// What the simulation needs from raylib: a clock and a seeded generator (xoshiro128** seeded
+// with splitmix64, the one raylib uses)
+static u64 randomSeed;
+static u32 randomState[4] = {0x96ea83c1, 0x218b21e5, 0xaa91febd, 0x976414d4};
+
+double GetTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+u64 splitMix64() {
+    u64 z = (randomSeed += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+void SetRandomSeed(unsigned int seed) {
+    randomSeed = seed;
+    randomState[0] = (u32)splitMix64();
+    randomState[1] = (u32)(splitMix64() >> 32);
+    randomState[2] = (u32)splitMix64();
+    randomState[3] = (u32)(splitMix64() >> 32);
+}
+
+u32 rotateLeft(u32 x, int k) { return (x << k) | (x >> (32 - k)); }
+
+u32 xoshiro128() {
+    u32 result = rotateLeft(randomState[1] * 5, 7) * 9;
+    u32 t = randomState[1] << 9;
+    randomState[2] ^= randomState[0];
+    randomState[3] ^= randomState[1];
+    randomState[1] ^= randomState[2];
+    randomState[0] ^= randomState[3];
+    randomState[2] ^= t;
+    randomState[3] = rotateLeft(randomState[3], 11);
+    return result;
+}
+
+int GetRandomValue(int min, int max) {
+    if (min > max) {
+        int swap = min;
+        min = max, max = swap;
+    }
+    return xoshiro128() % ((u32)(max - min) + 1) + min;
+}
+
+#include "sim.c"
+#include "raster.c"
+#include "export.c"
+
+// Runs the simulation without a window or GL context: fixed step, seeded, for a fixed number of
+// steps, then prints the throughput. With --frame or --record every step is also drawn by the
+// software rasterizer, --frame writes the last frame and --record streams all of them.
+int main(int argc, char **argv) {
+    u32 steps = 600, seed = DEFAULT_SEED;
+    const char *framePath = 0, *recordPath = 0;
+    Canvas canvas = {.width = 1920, .height = 1080};
+    dt = 1.0f / TARGET_FPS;
+    stepReports = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (parseSimArg(argc, argv, &i)) continue;
+
+        if (!strcmp(argv[i], "--steps") && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            seed = strtoul(argv[++i], 0, 0);
+        } else if (!strcmp(argv[i], "--dt") && i + 1 < argc) {
+            dt = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--verbose")) {
+            stepReports = true;
+        } else if (!strcmp(argv[i], "--frame") && i + 1 < argc) {
+            framePath = argv[++i];
+        } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc &&
+                   sscanf(argv[++i], "%dx%d", &canvas.width, &canvas.height) == 2 &&
+                   canvas.width > 0 && canvas.height > 0) {
+            continue;
+        } else {
+            printf("Usage: %s " SIM_USAGE " [--steps N] [--seed N] [--dt SECONDS] [--verbose] "
+                   "[--frame FILE.ppm] [--record FILE.y4m|ppm] [--size WxH]\n",
+                   argv[0]);
+            return 1;
+        }
+    }
+
+    initSimulation();
+    initJobs(numThreads);
+    SetRandomSeed(seed);
+    spawnPoints(initialPoints);
+
+    bool rasterize = framePath || recordPath;
+    if (rasterize) {
+        // aligned_alloc() wants a multiple of the alignment
+        u64 bytes = ((u64)canvas.width * canvas.height * 4 + 31) & ~31ul;
+        canvas.pixels = (u32 *)aligned_alloc(32, bytes);
+        if (!canvas.pixels) {
+            printf("Failed to allocate a %dx%d frame\n", canvas.width, canvas.height);
+            return 1;
+        }
+    }
+    if (recordPath && !startExport(recordPath, canvas.width, canvas.height, roundf(1 / dt))) {
+        return 1;
+    }
+    Camera2D camera = fitWorldCamera(canvas.width, canvas.height);
+
+    // Last frame drawn, straight into an export slot when one is free
+    Canvas *frame = &canvas;
+    double start = GetTime(), rasterSeconds = 0;
+    for (u32 step = 0; step < steps; step++) {
+        updateParticles();
+        if (!rasterize) continue;
+
+        double rasterStart = GetTime();
+        Canvas *slot = recordPath ? exportSlot() : 0;
+        frame = slot ? slot : &canvas;
+        rasterizeParticles(frame, camera);
+        if (slot) publishExportSlot();
+        rasterSeconds += GetTime() - rasterStart;
+    }
+    double seconds = GetTime() - start - rasterSeconds;
+
+    printf("%u particles, %u steps of %.4fs, %u threads in %.2fs: %.3fms per step, %.0f particle "
+           "steps/s\n",
+           pts.amount, steps, dt, numThreads, seconds, seconds * 1000 / steps,
+           (double)pts.amount * steps / seconds);
+    printf("State hash: %016lx\n", hashPoints());
+
+    if (rasterize) {
+        printf("%dx%d frames rasterized in %.3fms\n", canvas.width, canvas.height,
+               rasterSeconds * 1000 / steps);
+        if (framePath && !writePpm(frame, framePath)) return 1;
+        if (recordPath) finishExport();
+        free(canvas.pixels);
+    }
+
+    shutdownJobs();
+    reportMemory();
+    return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <raylib.h>
+
+#include "types.h"
+
+void benchmarkRender(Texture2D circle, u32 frames);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "types.h"
+
+// Splitting the world in slabs along x, one per process. Neighbouring processes talk through
+// single-producer single-consumer rings in a POSIX shared memory segment.
+#define MAX_PROCS 64
+#define RING_RECORDS 8192
+
+enum { RECORD_MIGRANT, RECORD_HALO, RECORD_END };
+
+typedef struct {
+    float positionX, positionY;
+    float speedX, speedY;
+    float radius;
+    u32 step;
+    u8 color;
+    u8 kind;
+} ParticleRecord;
+
+typedef struct {
+    _Alignas(64) atomic_ulong head;
+    _Alignas(64) atomic_ulong tail;
+    _Alignas(64) ParticleRecord records[RING_RECORDS];
+} ParticleRing;
+
+typedef struct {
+    u32 procs;
+    atomic_uint started;
+    atomic_ulong owned[MAX_PROCS];
+    atomic_ulong migrated[MAX_PROCS];
+    double seconds[MAX_PROCS];
+
+    // toRight[r] carries rank r -> r + 1, toLeft[r] carries rank r + 1 -> r
+    ParticleRing toRight[MAX_PROCS - 1];
+    ParticleRing toLeft[MAX_PROCS - 1];
+} DomainShared;
+
+typedef struct {
+    u32 rank;
+    float slabMin, slabMax;
+    DomainShared *shared;
+
+    ParticleRing *out[2], *in[2];
+
+    ParticleRecord *outbox[2];
+    u32 outCount[2], outCapacity[2];
+    ParticleRecord *inbox;
+    u32 inCount, inCapacity;
+} Domain;
+
+int runDomains(u32 procs, u32 steps, u32 points);
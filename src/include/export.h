@@ -0,0 +1,17 @@
+#pragma once
+
+#include "raster.h"
+#include "types.h"
+
+// Container of an exported run, chosen by the extension of the path
+typedef enum {
+    // Concatenated binary PPM images (ffmpeg reads it with -f image2pipe)
+    EXPORT_PPM,
+    // YUV4MPEG2 stream, 4:4:4 with BT.601 limited range
+    EXPORT_Y4M,
+} ExportFormat;
+
+bool startExport(const char *path, int width, int height, u32 fps);
+Canvas *exportSlot();
+void publishExportSlot();
+void finishExport();
@@ -3,13 +3,51 @@
 #include "memory.h"
 #include "types.h"
 
-static BumpAllocator *tempStorage;
+// Particle arrays, lives until the points are cleared
+static Arena *particleArena;
+// Scratch for one step. There are two so that what a step leaves behind is still valid during the
+// next one, and one more per thread for the workers.
+static Arena *frameArenas[2];
+static Arena *frameArena;
+static Arena *threadArenas[MAX_THREADS];
+// Scratch of the draw and raster passes, released before they return
+static Arena *renderArena;
+static u64 frameIndex;
 
 static Points pts;
+// Particles spawned at startup
+static u32 initialPoints = POINTS_ADDED;
+static u32 ownedPoints[MAX_THREADS + 1];
 
 static int PARTITION_SIZE;
+static int partitionsX, partitionsY;
+// Columns of the grid this process simulates, the whole grid unless the world is split in slabs
+static int columnsBegin, columnsEnd;
 static Partition parts[SPACE_PARTITIONS][SPACE_PARTITIONS];
+static Pool *spillPool;
+
+// https://coolors.co/palette/001219-005f73-0a9396-94d2bd-e9d8a6-ee9b00-ca6702-bb3e03-ae2012-9b2226
+static const Color colors[PALETTE_SIZE] = {
+    {0x00, 0x12, 0x19, 0xff}, {0x00, 0x5f, 0x73, 0xff}, {0x0a, 0x93, 0x96, 0xff},
+    {0x94, 0xd2, 0xbd, 0xff}, {0xe9, 0xd8, 0xa6, 0xff}, {0xee, 0x9b, 0x00, 0xff},
+    {0xca, 0x67, 0x02, 0xff}, {0xbb, 0x3e, 0x03, 0xff}, {0xae, 0x20, 0x12, 0xff},
+    {0x9b, 0x22, 0x26, 0xff},
+};
 
 static Vector2 worldSize = {2560, 1440};
-static int w, h;
 static float dt;
+
+static u32 numThreads = NUM_THREADS;
+static bool deterministic;
+static bool taskGraph;
+static bool jacobi;
+static bool halfError;
+// Timings (and hash) printed after every step
+static bool stepReports = true;
+static bool partitionsDirty = true;
+// The grid holds every particle exactly once, binned from positions at most one step old. The
+// renderer only culls through the grid while this is set.
+static bool partitionsValid;
+// Bumped whenever particles are added, removed or reordered: copies indexed like Points made
+// before are stale
+static u32 pointsVersion;
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "numa.h"
+#include "types.h"
+
+// Minimal fork/join pool. The calling thread always takes part in the work, so a pool of N
+// threads only spawns N - 1 workers.
+typedef void (*JobFn)(void *ctx, u32 index, u32 thread);
+
+struct {
+    pthread_t workers[MAX_THREADS];
+    u32 count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    u64 generation;
+    u32 finished;
+    bool quit;
+
+    JobFn fn;
+    void *ctx;
+    u32 jobs;
+    bool perThread;
+    atomic_uint next;
+} typedef JobPool;
+
+static JobPool jobPool;
+
+void drainJobs(u32 thread) {
+    if (jobPool.perThread) {
+        if (thread < jobPool.jobs) jobPool.fn(jobPool.ctx, thread, thread);
+        return;
+    }
+
+    for (;;) {
+        u32 index = atomic_fetch_add_explicit(&jobPool.next, 1, memory_order_relaxed);
+        if (index >= jobPool.jobs) break;
+        jobPool.fn(jobPool.ctx, index, thread);
+    }
+}
+
+void *jobWorker(void *arg) {
+    u32 thread = (u32)(uintptr_t)arg;
+    u64 seen = 0;
+
+    if (pinThreads) pinThread(thread);
+
+    pthread_mutex_lock(&jobPool.lock);
+    for (;;) {
+        while (jobPool.generation == seen && !jobPool.quit) {
+            pthread_cond_wait(&jobPool.wake, &jobPool.lock);
+        }
+        if (jobPool.quit) break;
+        seen = jobPool.generation;
+        pthread_mutex_unlock(&jobPool.lock);
+
+        drainJobs(thread);
+
+        pthread_mutex_lock(&jobPool.lock);
+        if (++jobPool.finished == jobPool.count - 1) pthread_cond_signal(&jobPool.done);
+    }
+    pthread_mutex_unlock(&jobPool.lock);
+
+    return 0;
+}
+
+void initJobs(u32 threads) {
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+    jobPool.count = threads;
+    pthread_mutex_init(&jobPool.lock, 0);
+    pthread_cond_init(&jobPool.wake, 0);
+    pthread_cond_init(&jobPool.done, 0);
+
+    if (pinThreads) {
+        planThreadCpus(threads);
+        pinThread(0);
+    }
+
+    for (u32 t = 1; t < threads; t++) {
+        pthread_create(&jobPool.workers[t], 0, jobWorker, (void *)(uintptr_t)t);
+    }
+}
+
+void dispatchJobs(JobFn fn, void *ctx, u32 count, bool perThread) {
+    pthread_mutex_lock(&jobPool.lock);
+    jobPool.fn = fn;
+    jobPool.ctx = ctx;
+    jobPool.jobs = count;
+    jobPool.perThread = perThread;
+    jobPool.finished = 0;
+    atomic_store_explicit(&jobPool.next, 0, memory_order_relaxed);
+    jobPool.generation++;
+    pthread_cond_broadcast(&jobPool.wake);
+    pthread_mutex_unlock(&jobPool.lock);
+
+    drainJobs(0);
+
+    pthread_mutex_lock(&jobPool.lock);
+    while (jobPool.finished < jobPool.count - 1) pthread_cond_wait(&jobPool.done, &jobPool.lock);
+    pthread_mutex_unlock(&jobPool.lock);
+}
+
+// Runs fn(ctx, i, thread) for every i in [0, count) and returns once all of them are done.
+// Indices are handed out dynamically, so fn must not care which thread runs which index.
+void runJobs(JobFn fn, void *ctx, u32 count) {
+    if (count == 0) return;
+
+    if (jobPool.count <= 1 || count == 1) {
+        for (u32 i = 0; i < count; i++) fn(ctx, i, 0);
+        return;
+    }
+
+    dispatchJobs(fn, ctx, count, false);
+}
+
+// Runs fn(ctx, t, t) exactly once on every thread t of the pool. Used for work that has to stay
+// on the same (pinned) thread from one frame to the next.
+void runJobsPerThread(JobFn fn, void *ctx) {
+    if (jobPool.count <= 1) {
+        fn(ctx, 0, 0);
+        return;
+    }
+
+    dispatchJobs(fn, ctx, jobPool.count, true);
+}
+
+#define MAX_TASKS 1024
+#define MAX_SUCCESSORS 4
+
+typedef struct {
+    JobFn fn;
+    void *ctx;
+    u32 index;
+
+    u32 dependencies;
+    atomic_uint pending;
+    u32 successorCount;
+    u32 successors[MAX_SUCCESSORS];
+} Task;
+
+// Dependency graph of tasks. Every task is pushed on the ready list exactly once, so the list is a
+// plain array with a shared read and write cursor.
+typedef struct {
+    Task tasks[MAX_TASKS];
+    u32 count;
+
+    atomic_uint ready[MAX_TASKS];
+    atomic_uint head, tail;
+    atomic_uint remaining;
+} TaskGraph;
+
+void clearTaskGraph(TaskGraph *graph) { graph->count = 0; }
+
+u32 addTask(TaskGraph *graph, JobFn fn, void *ctx, u32 index) {
+    u32 id = graph->count++;
+    Task *task = &graph->tasks[id];
+    task->fn = fn;
+    task->ctx = ctx;
+    task->index = index;
+    task->dependencies = 0;
+    task->successorCount = 0;
+    return id;
+}
+
+void addDependency(TaskGraph *graph, u32 before, u32 after) {
+    Task *task = &graph->tasks[before];
+    task->successors[task->successorCount++] = after;
+    graph->tasks[after].dependencies++;
+}
+
+void pushTask(TaskGraph *graph, u32 id) {
+    u32 slot = atomic_fetch_add(&graph->tail, 1);
+    atomic_store_explicit(&graph->ready[slot], id + 1, memory_order_release);
+}
+
+void drainTaskGraph(void *ctx, u32 index, u32 thread) {
+    TaskGraph *graph = (TaskGraph *)ctx;
+
+    while (atomic_load(&graph->remaining) > 0) {
+        u32 head = atomic_load(&graph->head);
+        if (head >= atomic_load(&graph->tail)) {
+            sched_yield();
+            continue;
+        }
+        if (!atomic_compare_exchange_weak(&graph->head, &head, head + 1)) continue;
+
+        // The slot is claimed before the pusher is done writing it
+        u32 id;
+        while (!(id = atomic_load_explicit(&graph->ready[head], memory_order_acquire))) {}
+
+        Task *task = &graph->tasks[id - 1];
+        task->fn(task->ctx, task->index, thread);
+
+        for (u32 s = 0; s < task->successorCount; s++) {
+            u32 next = task->successors[s];
+            if (atomic_fetch_sub(&graph->tasks[next].pending, 1) == 1) pushTask(graph, next);
+        }
+        atomic_fetch_sub(&graph->remaining, 1);
+    }
+}
+
+// Runs every task of the graph on the pool, each one as soon as all of its dependencies are done
+void runTaskGraph(TaskGraph *graph) {
+    atomic_store(&graph->head, 0);
+    atomic_store(&graph->tail, 0);
+    atomic_store(&graph->remaining, graph->count);
+    for (u32 id = 0; id < graph->count; id++) {
+        atomic_store_explicit(&graph->ready[id], 0, memory_order_relaxed);
+        atomic_store_explicit(&graph->tasks[id].pending, graph->tasks[id].dependencies,
+                              memory_order_relaxed);
+    }
+    for (u32 id = 0; id < graph->count; id++) {
+        if (!graph->tasks[id].dependencies) pushTask(graph, id);
+    }
+
+    runJobsPerThread(drainTaskGraph, graph);
+}
+
+void shutdownJobs() {
+    pthread_mutex_lock(&jobPool.lock);
+    jobPool.quit = true;
+    pthread_cond_broadcast(&jobPool.wake);
+    pthread_mutex_unlock(&jobPool.lock);
+
+    for (u32 t = 1; t < jobPool.count; t++) pthread_join(jobPool.workers[t], 0);
+    jobPool.count = 1;
+}
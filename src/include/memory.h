@@ -1,22 +1,82 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "types.h"
 
-#define KB(x) x * 1024
-#define MB(x) KB(x) * 1024
+#define KB(x) ((u64)(x) << 10)
+#define MB(x) ((u64)(x) << 20)
+#define GB(x) ((u64)(x) << 30)
+
+// Virtual arenas commit memory in steps of this size, a multiple of the huge page size
+#define ARENA_COMMIT MB(2)
 
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-struct {
-    u64 size;
+// What the memory is used for. Every arena and pool is created with one of these, and the usage
+// of each tag can be queried with getMemoryStats().
+typedef enum { TAG_PARTICLES, TAG_GRID, TAG_SCRATCH, TAG_RENDER, MEMORY_TAGS } MemoryTag;
+
+static const char *memoryTagNames[MEMORY_TAGS] = {"particles", "grid", "scratch", "render"};
+
+// Arena made of a chain of blocks. Running out of space chains a new block instead of failing,
+// and blocks are kept around after a reset or a restore so that they can be reused.
+//
+// Virtual arenas reserve the whole block as address space up front and only commit it in
+// ARENA_COMMIT steps as it gets used, so a large arena costs nothing until it is touched.
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    struct ArenaBlock *next;
+    u64 size;     // usable (committed) bytes
+    u64 reserved; // bytes the block can grow to
     u64 used;
     u8 *memory;
-} typedef BumpAllocator;
+} ArenaBlock;
+
+struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+    u64 blockSize;
+    bool virtualMemory;
+    bool hugePages;
+
+    MemoryTag tag;
+    u64 live; // bytes handed out since the last reset, alignment included
+    u64 peak;
+} typedef Arena;
+
+// Position in an arena, everything allocated after it is released by restoreMark()
+struct {
+    ArenaBlock *block;
+    u64 used;
+} typedef ArenaMark;
+
+struct {
+    u64 live;
+    u64 peak;      // sum of the high-water marks of the tag's arenas
+    u64 committed; // backed by memory, or at least allowed to be
+    u64 reserved;  // address space
+    u64 wasted;    // committed but skipped over, at the end of blocks the arenas have moved past
+    u32 arenas;
+    u32 blocks;
+} typedef MemoryStats;
+
+#define MAX_ARENAS 128
+#define MAX_POOLS 8
+
+static Arena *arenas[MAX_ARENAS];
+static u32 arenaCount;
+// Memory that is not allocated at runtime but still worth counting, like the grid
+static u64 staticMemory[MEMORY_TAGS];
+
+void reportMemory();
 
 void crash() {
     int *x = 0;
@@ -24,46 +84,480 @@ void crash() {
     *x = 2;
 }
 
-BumpAllocator *NewBumpAlloc(u64 len) {
-    BumpAllocator *ba = (BumpAllocator *)malloc(sizeof(BumpAllocator));
+ArenaBlock *newHeapBlock(u64 len) {
+    ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + len);
+    if (!block) return 0;
+
+    block->size = block->reserved = len;
+    block->memory = (u8 *)(block + 1);
+    return block;
+}
+
+ArenaBlock *newVirtualBlock(u64 len, bool hugePages) {
+    len = (len + ARENA_COMMIT - 1) & ~(ARENA_COMMIT - 1);
 
-    ba->size = len;
-    ba->used = 0;
-    ba->memory = (u8 *)malloc(len);
+    // Reserve one extra commit step to be able to align the block to it (and so to huge pages)
+    u8 *reserved = (u8 *)mmap(0, len + ARENA_COMMIT, PROT_NONE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) return 0;
 
-    if (!ba->memory) {
-        printf("ERROR: Failed to allocate memory for the bumpAllocator!");
+    u8 *memory = (u8 *)(((uintptr_t)reserved + ARENA_COMMIT - 1) & ~(ARENA_COMMIT - 1));
+    if (hugePages) madvise(memory, len, MADV_HUGEPAGE);
+
+    ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock));
+    if (!block) {
+        munmap(reserved, len + ARENA_COMMIT);
+        return 0;
+    }
+
+    block->size = 0;
+    block->reserved = len;
+    block->memory = memory;
+    return block;
+}
+
+ArenaBlock *newArenaBlock(Arena *arena, u64 len) {
+    ArenaBlock *block =
+        arena->virtualMemory ? newVirtualBlock(len, arena->hugePages) : newHeapBlock(len);
+    if (!block) {
+        printf("ERROR: Failed to allocate a block of %lu bytes for the %s arena!\n", len,
+               memoryTagNames[arena->tag]);
+        reportMemory();
         crash();
-        ba->size = 0;
         return 0;
     }
 
-    memset(ba->memory, 0, ba->size);
-    return ba;
+    block->prev = block->next = 0;
+    block->used = 0;
+    return block;
 }
 
-void freeBumpAllocator(BumpAllocator *alloc) {
-    memset(alloc->memory, 0, alloc->used + 1);
-    alloc->used = 0;
+// Makes at least `needed` bytes of a block usable, fails if it would not fit in its reservation
+bool commitArenaBlock(ArenaBlock *block, u64 needed) {
+    if (needed <= block->size) return true;
+    if (needed > block->reserved) return false;
+
+    u64 size = (needed + ARENA_COMMIT - 1) & ~(ARENA_COMMIT - 1);
+    if (size > block->reserved) size = block->reserved;
+
+    if (mprotect(block->memory + block->size, size - block->size, PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect");
+        return false;
+    }
+
+    block->size = size;
+    return true;
 }
 
-u8 *alloc(BumpAllocator *alloc, u8 alignment, size_t len) {
-    u8 *result = 0;
+void registerArena(Arena *arena) {
+    if (arenaCount < MAX_ARENAS) arenas[arenaCount++] = arena;
+}
 
-    size_t adjustment = (alignment - ((uintptr_t)(alloc->memory + alloc->used) & (alignment - 1))) &
-                        (alignment - 1);
+Arena *NewArena(u64 blockSize, MemoryTag tag) {
+    Arena *arena = (Arena *)calloc(1, sizeof(Arena));
 
-    size_t alignedSize = len + adjustment;
+    arena->blockSize = blockSize;
+    arena->tag = tag;
+    arena->first = arena->current = newArenaBlock(arena, blockSize);
 
-    if (alloc->used + alignedSize > alloc->size) {
-        printf("Not enough space in BumpAllocator\n");
-        printf("Used %lu. New Size: %lu. Capacity: %lu.\n", alloc->used, alignedSize, alloc->size);
-        crash();
-        return result;
+    if (!arena->first) {
+        free(arena);
+        return 0;
+    }
+
+    registerArena(arena);
+    return arena;
+}
+
+// Arena backed by reserved address space. Pages are zero and only faulted in when first touched,
+// with `hugePages` they are also eligible for transparent huge pages.
+Arena *NewVirtualArena(u64 reserve, bool hugePages, MemoryTag tag) {
+    Arena *arena = (Arena *)calloc(1, sizeof(Arena));
+
+    arena->blockSize = reserve;
+    arena->tag = tag;
+    arena->virtualMemory = true;
+    arena->hugePages = hugePages;
+    arena->first = arena->current = newArenaBlock(arena, reserve);
+
+    if (!arena->first) {
+        free(arena);
+        return 0;
+    }
+
+    registerArena(arena);
+    return arena;
+}
+
+// Released memory is only poisoned in debug builds, in release a reset or restore is O(1)
+void poisonArena(ArenaBlock *block, u64 from) {
+#ifdef DEBUG
+    for (; block; block = block->next, from = 0) {
+        memset(block->memory + from, 0xcd, block->used - from);
+    }
+#endif
+}
+
+void resetArena(Arena *arena) {
+    poisonArena(arena->first, 0);
+    arena->current = arena->first;
+    arena->current->used = 0;
+    arena->live = 0;
+}
+
+ArenaMark getMark(Arena *arena) { return (ArenaMark){arena->current, arena->current->used}; }
+
+void restoreMark(Arena *arena, ArenaMark mark) {
+    poisonArena(mark.block, mark.used);
+    for (ArenaBlock *block = mark.block; block != arena->current; block = block->next) {
+        arena->live -= block->used;
     }
+    arena->live -= arena->current->used - mark.used;
 
-    result = alloc->memory + alloc->used + adjustment;
-    alloc->used += alignedSize;
+    arena->current = mark.block;
+    arena->current->used = mark.used;
+}
+
+// Gives the physical pages of a dead range of a virtual arena back to the OS. The range stays
+// mapped and reads as zeros if it is ever touched again, it no longer counts as live.
+void releaseArenaRange(Arena *arena, u8 *start, u64 len) {
+    if (!arena->virtualMemory) return;
+    arena->live -= len;
+
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t from = ((uintptr_t)start + page - 1) & ~(page - 1);
+    uintptr_t to = ((uintptr_t)start + len) & ~(page - 1);
+    if (to > from) madvise((void *)from, to - from, MADV_DONTNEED);
+}
+
+size_t alignmentFor(ArenaBlock *block, u8 alignment) {
+    return (alignment - ((uintptr_t)(block->memory + block->used) & (alignment - 1))) &
+           (alignment - 1);
+}
+
+u8 *alloc(Arena *arena, u8 alignment, size_t len) {
+    ArenaBlock *block = arena->current;
+    size_t adjustment = alignmentFor(block, alignment);
+
+    while (!commitArenaBlock(block, block->used + len + adjustment)) {
+        // Blocks after the current one are left over from a reset or a restore, reuse them if
+        // they are big enough, otherwise chain a new one right after the current block
+        ArenaBlock *next = block->next;
+        if (!next || next->reserved < len + alignment) {
+            u64 size = len + alignment > arena->blockSize ? len + alignment : arena->blockSize;
+            ArenaBlock *fresh = newArenaBlock(arena, size);
+            if (!fresh) return 0;
+
+            fresh->prev = block;
+            fresh->next = next;
+            if (next) next->prev = fresh;
+            block->next = fresh;
+            next = fresh;
+        }
+
+        block = arena->current = next;
+        block->used = 0;
+        adjustment = alignmentFor(block, alignment);
+    }
+
+    u8 *result = block->memory + block->used + adjustment;
+    block->used += len + adjustment;
+
+    arena->live += len + adjustment;
+    if (arena->live > arena->peak) arena->peak = arena->live;
 
     return result;
 }
+
+// Pool of fixed-size objects. The slabs are carved one after the other from the pool's own
+// virtual arena, so every object has an index and the free list can be a lock-free stack of
+// indices, with an ABA tag next to the head. Each thread keeps a small cache of free objects and
+// only touches the shared stack in batches. Carving a new slab is the only path that locks.
+#define POOL_CACHE 64
+#define POOL_MAX_SLABS 4096
+
+typedef struct {
+    _Alignas(64) u32 count;
+    u32 objects[POOL_CACHE];
+    u64 allocs;
+    u64 frees;
+} PoolCache;
+
+struct {
+    u32 objectSize;
+    u32 slabObjects;
+    Arena *arena;
+    u8 *base;
+
+    pthread_mutex_t growLock;
+    atomic_uint slabCount;
+    u32 emptySlabs[POOL_MAX_SLABS]; // given back by trimPool() but still below slabCount
+    u32 emptyCount;
+    u64 slabsReturned;
+
+    // index + 1 of the first free object in the low half, ABA tag in the high one
+    atomic_ulong freeList;
+    PoolCache caches[MAX_THREADS];
+} typedef Pool;
+
+struct {
+    u64 allocs;
+    u64 frees;
+    u64 live;
+    u32 slabs;
+    u32 emptySlabs;
+    u64 slabsReturned;
+} typedef PoolStats;
+
+static Pool *pools[MAX_POOLS];
+static u32 poolCount;
+
+Pool *NewPool(u32 objectSize, u32 slabObjects, MemoryTag tag) {
+    Pool *pool = (Pool *)calloc(1, sizeof(Pool));
+
+    pool->objectSize = (objectSize + 7) & ~7u;
+    pool->slabObjects = slabObjects;
+    u64 reserve = (u64)pool->objectSize * slabObjects * POOL_MAX_SLABS;
+    pool->arena = NewVirtualArena(reserve, false, tag);
+
+    if (!pool->arena) {
+        free(pool);
+        return 0;
+    }
+
+    pthread_mutex_init(&pool->growLock, 0);
+    pool->base = pool->arena->first->memory;
+    if (poolCount < MAX_POOLS) pools[poolCount++] = pool;
+    return pool;
+}
+
+void *poolObject(Pool *pool, u32 index) { return pool->base + (u64)index * pool->objectSize; }
+
+u32 poolIndex(Pool *pool, void *object) { return ((u8 *)object - pool->base) / pool->objectSize; }
+
+// Free objects hold the index + 1 of the next free one in their first word
+atomic_uint *poolLink(Pool *pool, u32 index) { return (atomic_uint *)poolObject(pool, index); }
+
+// Pushes a chain of free objects, already linked from first to last, on the shared stack
+void pushFreeChain(Pool *pool, u32 first, u32 last) {
+    u64 head = atomic_load_explicit(&pool->freeList, memory_order_relaxed), next;
+    do {
+        atomic_store_explicit(poolLink(pool, last), (u32)head, memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | (first + 1);
+    } while (!atomic_compare_exchange_weak_explicit(&pool->freeList, &head, next,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+bool popFree(Pool *pool, u32 *index) {
+    u64 head = atomic_load_explicit(&pool->freeList, memory_order_acquire), next;
+    do {
+        u32 top = (u32)head;
+        if (!top) return false;
+
+        // The top may be popped and written by another thread meanwhile, the tag then fails the CAS
+        u32 link = atomic_load_explicit(poolLink(pool, top - 1), memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | link;
+        *index = top - 1;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->freeList, &head, next,
+                                                    memory_order_acquire, memory_order_acquire));
+    return true;
+}
+
+// Adds a slab of free objects, reusing one given back by trimPool() if there is any
+void growPool(Pool *pool) {
+    pthread_mutex_lock(&pool->growLock);
+
+    // Another thread may have grown the pool while we waited for the lock
+    if ((u32)atomic_load(&pool->freeList)) {
+        pthread_mutex_unlock(&pool->growLock);
+        return;
+    }
+
+    u32 slab;
+    if (pool->emptyCount) {
+        slab = pool->emptySlabs[--pool->emptyCount];
+        pool->arena->live += (u64)pool->objectSize * pool->slabObjects;
+        if (pool->arena->live > pool->arena->peak) pool->arena->peak = pool->arena->live;
+    } else {
+        slab = atomic_load(&pool->slabCount);
+        if (slab >= POOL_MAX_SLABS) {
+            printf("ERROR: Pool of %u byte objects is out of slabs!\n", pool->objectSize);
+            crash();
+        }
+        alloc(pool->arena, 8, (u64)pool->objectSize * pool->slabObjects);
+        atomic_store(&pool->slabCount, slab + 1);
+    }
+
+    u32 first = slab * pool->slabObjects, last = first + pool->slabObjects - 1;
+    for (u32 i = first; i < last; i++) {
+        atomic_store_explicit(poolLink(pool, i), i + 2, memory_order_relaxed);
+    }
+    pushFreeChain(pool, first, last);
+
+    pthread_mutex_unlock(&pool->growLock);
+}
+
+void *poolAlloc(Pool *pool, u32 thread) {
+    PoolCache *cache = &pool->caches[thread];
+    while (unlikely(!cache->count)) {
+        u32 index;
+        while (cache->count < POOL_CACHE / 2 && popFree(pool, &index)) {
+            cache->objects[cache->count++] = index;
+        }
+        if (!cache->count) growPool(pool);
+    }
+
+    cache->allocs++;
+    return poolObject(pool, cache->objects[--cache->count]);
+}
+
+// Moves everything above `keep` from a thread's cache to the shared stack in one push
+void flushPoolCache(Pool *pool, PoolCache *cache, u32 keep) {
+    if (cache->count <= keep) return;
+
+    for (u32 i = keep; i + 1 < cache->count; i++) {
+        atomic_store_explicit(poolLink(pool, cache->objects[i]), cache->objects[i + 1] + 1,
+                              memory_order_relaxed);
+    }
+    pushFreeChain(pool, cache->objects[keep], cache->objects[cache->count - 1]);
+    cache->count = keep;
+}
+
+void poolFree(Pool *pool, u32 thread, void *object) {
+    PoolCache *cache = &pool->caches[thread];
+    if (unlikely(cache->count == POOL_CACHE)) flushPoolCache(pool, cache, POOL_CACHE / 2);
+
+    cache->frees++;
+    cache->objects[cache->count++] = poolIndex(pool, object);
+}
+
+// Gives the slabs whose objects are all free back: slabs at the end are popped off the pool's
+// arena, the pages of the others are released and the slab is reused by the next growPool().
+// Walks the whole free list, so it must only run while no other thread uses the pool.
+void trimPool(Pool *pool, Arena *scratch) {
+    for (u32 t = 0; t < MAX_THREADS; t++) flushPoolCache(pool, &pool->caches[t], 0);
+
+    u32 slabs = atomic_load(&pool->slabCount);
+    if (!slabs) return;
+
+    ArenaMark mark = getMark(scratch);
+    u32 *freeCount = (u32 *)alloc(scratch, 8, slabs * sizeof(u32));
+    memset(freeCount, 0, slabs * sizeof(u32));
+
+    u64 head = atomic_load(&pool->freeList);
+    for (u32 at = (u32)head; at; at = atomic_load_explicit(poolLink(pool, at - 1), 0)) {
+        freeCount[(at - 1) / pool->slabObjects]++;
+    }
+
+    u32 emptied = 0;
+    for (u32 slab = 0; slab < slabs; slab++) emptied += freeCount[slab] == pool->slabObjects;
+    if (!emptied) {
+        restoreMark(scratch, mark);
+        return;
+    }
+
+    // Unlink the objects of the empty slabs, keeping the others in the same order
+    u32 first = 0, last = 0;
+    for (u32 at = (u32)head; at;) {
+        u32 next = atomic_load_explicit(poolLink(pool, at - 1), 0);
+        if (freeCount[(at - 1) / pool->slabObjects] != pool->slabObjects) {
+            if (last) atomic_store_explicit(poolLink(pool, last - 1), at, 0);
+            else first = at;
+            last = at;
+        }
+        at = next;
+    }
+    if (last) atomic_store_explicit(poolLink(pool, last - 1), 0, 0);
+    atomic_store(&pool->freeList, ((head >> 32) + 1) << 32 | first);
+
+    // Slabs given back earlier are off the free list and count as empty too
+    u8 *empty = (u8 *)alloc(scratch, 8, slabs);
+    for (u32 slab = 0; slab < slabs; slab++) empty[slab] = freeCount[slab] == pool->slabObjects;
+    for (u32 e = 0; e < pool->emptyCount; e++) empty[pool->emptySlabs[e]] = true;
+
+    u32 kept = slabs;
+    while (kept && empty[kept - 1]) kept--;
+    pool->emptyCount = 0;
+    for (u32 slab = 0; slab < kept; slab++) {
+        if (empty[slab]) pool->emptySlabs[pool->emptyCount++] = slab;
+    }
+
+    // Releasing takes the slabs emptied now out of the live bytes, the ones given back earlier
+    // already are, so the end of the arena is moved without a restoreMark()
+    u64 slabBytes = (u64)pool->objectSize * pool->slabObjects;
+    for (u32 slab = 0; slab < slabs; slab++) {
+        if (freeCount[slab] != pool->slabObjects) continue;
+        releaseArenaRange(pool->arena, pool->base + slab * slabBytes, slabBytes);
+    }
+    pool->arena->first->used = kept * slabBytes;
+
+    atomic_store(&pool->slabCount, kept);
+    pool->slabsReturned += emptied;
+    restoreMark(scratch, mark);
+}
+
+PoolStats getPoolStats(Pool *pool) {
+    PoolStats stats = {0};
+    for (u32 t = 0; t < MAX_THREADS; t++) {
+        stats.allocs += pool->caches[t].allocs;
+        stats.frees += pool->caches[t].frees;
+    }
+
+    stats.live = stats.allocs - stats.frees;
+    stats.slabs = atomic_load(&pool->slabCount) - pool->emptyCount;
+    stats.emptySlabs = pool->emptyCount;
+    stats.slabsReturned = pool->slabsReturned;
+    return stats;
+}
+
+void trackStaticMemory(MemoryTag tag, u64 bytes) { staticMemory[tag] += bytes; }
+
+// Walks the arenas of a tag. Arenas are not locked, so call it between steps.
+MemoryStats getMemoryStats(MemoryTag tag) {
+    MemoryStats stats = {0};
+    stats.live = stats.peak = stats.committed = stats.reserved = staticMemory[tag];
+
+    for (u32 a = 0; a < arenaCount; a++) {
+        Arena *arena = arenas[a];
+        if (arena->tag != tag) continue;
+
+        stats.arenas++;
+        stats.live += arena->live;
+        stats.peak += arena->peak;
+
+        bool passed = true;
+        for (ArenaBlock *block = arena->first; block; block = block->next) {
+            if (block == arena->current) passed = false;
+            else if (passed) stats.wasted += block->size - block->used;
+
+            stats.blocks++;
+            stats.committed += block->size;
+            stats.reserved += block->reserved;
+        }
+    }
+
+    return stats;
+}
+
+void reportMemory() {
+    printf("Memory:\n");
+    for (int tag = 0; tag < MEMORY_TAGS; tag++) {
+        MemoryStats stats = getMemoryStats((MemoryTag)tag);
+        if (!stats.reserved) continue;
+
+        printf(" - %s: %.1fMB live, %.1fMB peak, %.1fMB committed, %.1fMB reserved, "
+               "%.1fMB wasted in %u blocks of %u arenas\n",
+               memoryTagNames[tag], stats.live / (double)MB(1), stats.peak / (double)MB(1),
+               stats.committed / (double)MB(1), stats.reserved / (double)MB(1),
+               stats.wasted / (double)MB(1), stats.blocks, stats.arenas);
+    }
+
+    // Free objects inside slabs that are still in use are the fragmentation of a pool
+    for (u32 p = 0; p < poolCount; p++) {
+        PoolStats stats = getPoolStats(pools[p]);
+        u64 capacity = (u64)stats.slabs * pools[p]->slabObjects;
+        printf(" - %s pool: %lu of %lu objects of %u bytes in use (%.0f%%), %u empty slabs\n",
+               memoryTagNames[pools[p]->arena->tag], stats.live, capacity, pools[p]->objectSize,
+               capacity ? stats.live * 100.0 / capacity : 100.0, stats.emptySlabs);
+    }
+}
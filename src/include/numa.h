@@ -0,0 +1,117 @@
+#pragma once
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "types.h"
+
+static bool pinThreads;
+static bool numaPlacement;
+static bool numaReport;
+
+static int threadCpus[MAX_THREADS];
+static int threadNodes[MAX_THREADS];
+
+int cpuNode(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+
+    int node = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (!strncmp(entry->d_name, "node", 4) && entry->d_name[4] >= '0' &&
+            entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+// Spreads the threads evenly over the CPUs we are allowed to run on, ordered by node, so that
+// consecutive threads (and so neighbouring stripes of the grid) end up on the same node.
+void planThreadCpus(u32 threads) {
+    cpu_set_t set;
+    sched_getaffinity(0, sizeof(set), &set);
+
+    static int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE];
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) continue;
+
+        int node = cpuNode(cpu), at = count++;
+        for (; at > 0 && nodes[at - 1] > node; at--) {
+            cpus[at] = cpus[at - 1];
+            nodes[at] = nodes[at - 1];
+        }
+        cpus[at] = cpu;
+        nodes[at] = node;
+    }
+
+    for (u32 t = 0; t < threads; t++) {
+        int at = count ? t * count / threads : 0;
+        threadCpus[t] = count ? cpus[at] : 0;
+        threadNodes[t] = count ? nodes[at] : 0;
+    }
+}
+
+void pinThread(u32 thread) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(threadCpus[thread], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// mbind and move_pages work on whole pages, so only the pages fully inside a range are touched
+void pageRange(void *start, u64 len, uintptr_t *from, uintptr_t *to) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    *from = ((uintptr_t)start + page - 1) & ~(page - 1);
+    *to = ((uintptr_t)start + len) & ~(page - 1);
+}
+
+void bindToNode(void *start, u64 len, int node) {
+    uintptr_t from, to;
+    pageRange(start, len, &from, &to);
+    if (to <= from) return;
+
+    unsigned long mask[4] = {0};
+    mask[node / 64] |= 1ul << (node % 64);
+    if (syscall(SYS_mbind, from, to - from, MPOL_BIND, mask, 256, MPOL_MF_MOVE) != 0) {
+        perror("mbind");
+    }
+}
+
+// Returns the fraction of the resident pages in a range that live on `node`, or -1 if none of
+// them has been faulted in yet
+float pagesOnNode(void *start, u64 len, int node) {
+    uintptr_t from, to, page = sysconf(_SC_PAGESIZE);
+    pageRange(start, len, &from, &to);
+
+    u64 local = 0, total = 0;
+    void *pages[256];
+    int status[256];
+    while (from < to) {
+        unsigned long count = 0;
+        for (; count < 256 && from < to; count++, from += page) pages[count] = (void *)from;
+
+        if (syscall(SYS_move_pages, 0, count, pages, 0, status, 0) != 0) return -1;
+        for (unsigned long p = 0; p < count; p++) {
+            if (status[p] == node) local++;
+            if (status[p] >= 0) total++;
+        }
+    }
+
+    return total ? (float)local / total : -1;
+}
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <immintrin.h>
+#include <math.h>
+
+#include "globals.h"
+#include "types.h"
+
+// Accessors for the positions, speeds and radiuses of Points, so that kernels do not depend on how
+// they are stored. The load/store versions work on the 8 particles starting at i, a multiple of 8.
+
+// Half storage encoding, also built without HALF_STORAGE to measure what it would lose. Offsets
+// span from half a cell before the cell to half a cell after it, so the particles slightly
+// outside the world that are about to bounce still fit.
+#define OFFSET_MAX 65535.0f
+
+float offsetStep() { return 2.0f * PARTITION_SIZE / OFFSET_MAX; }
+
+int clampCell(int cell, int cells) { return cell < 0 ? 0 : (cell >= cells ? cells - 1 : cell); }
+
+// Where the offsets of a cell start. Cell coordinates are integers, so this is exact and the
+// offset is taken from the position directly rather than from a shifted, already rounded one.
+float offsetBase(int cell, float half) {
+    return cell * PARTITION_SIZE - PARTITION_SIZE * 0.5f - half;
+}
+
+void encodePosition(float position, float half, int cells, u8 *cell, u16 *offset) {
+    int at = clampCell(floorf((position + half) / PARTITION_SIZE), cells);
+    float fixed = (position - offsetBase(at, half)) / offsetStep() + 0.5f;
+
+    *cell = at;
+    *offset = fixed < 0 ? 0 : (fixed > OFFSET_MAX ? OFFSET_MAX : fixed);
+}
+
+float decodePosition(u8 cell, u16 offset, float half) {
+    return offsetBase(cell, half) + offset * offsetStep();
+}
+
+__m256 decodePositions(const u8 *cells, const u16 *offsets, float half) {
+    __m256 cell = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)cells)));
+    __m256 offset = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_load_si128((__m128i *)offsets)));
+
+    __m256 base = _mm256_sub_ps(_mm256_mul_ps(cell, _mm256_set1_ps(PARTITION_SIZE)),
+                                _mm256_set1_ps(PARTITION_SIZE * 0.5f + half));
+    return _mm256_add_ps(base, _mm256_mul_ps(offset, _mm256_set1_ps(offsetStep())));
+}
+
+void encodePositions(__m256 positions, float half, int cells, u8 *cellsOut, u16 *offsetsOut) {
+    const __m256 size = _mm256_set1_ps(PARTITION_SIZE);
+    __m256 shifted = _mm256_add_ps(positions, _mm256_set1_ps(half));
+
+    __m256i cell = _mm256_cvttps_epi32(_mm256_floor_ps(_mm256_div_ps(shifted, size)));
+    cell = _mm256_min_epi32(_mm256_max_epi32(cell, _mm256_setzero_si256()),
+                            _mm256_set1_epi32(cells - 1));
+
+    __m256 base = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(cell), size),
+                                _mm256_set1_ps(PARTITION_SIZE * 0.5f + half));
+    __m256 fixed = _mm256_sub_ps(positions, base);
+    fixed = _mm256_add_ps(_mm256_div_ps(fixed, _mm256_set1_ps(offsetStep())), _mm256_set1_ps(0.5f));
+    fixed = _mm256_min_ps(_mm256_max_ps(fixed, _mm256_setzero_ps()), _mm256_set1_ps(OFFSET_MAX));
+    __m256i offset = _mm256_cvttps_epi32(fixed);
+
+    // 32 bit lanes down to 16 and 8 bits, packing works within each 128 bit half
+    __m128i offsets16 = _mm_packus_epi32(_mm256_castsi256_si128(offset),
+                                         _mm256_extracti128_si256(offset, 1));
+    __m128i cells16 =
+        _mm_packus_epi32(_mm256_castsi256_si128(cell), _mm256_extracti128_si256(cell, 1));
+    _mm_store_si128((__m128i *)offsetsOut, offsets16);
+    _mm_storel_epi64((__m128i *)cellsOut, _mm_packus_epi16(cells16, cells16));
+}
+
+// Copies particle `from` of the arrays `src` to particle `to` of `dst`, whatever their layout
+void copyBlockPoint(PointBlock *dst, u32 to, const PointBlock *src, u32 from) {
+    const PointBlock *in = &src[from >> 3];
+    PointBlock *out = &dst[to >> 3];
+    out->positionsX[to & 7] = in->positionsX[from & 7];
+    out->positionsY[to & 7] = in->positionsY[from & 7];
+    out->speedsX[to & 7] = in->speedsX[from & 7];
+    out->speedsY[to & 7] = in->speedsY[from & 7];
+    out->radiuses[to & 7] = in->radiuses[from & 7];
+}
+
+#define copyPoint(dst, to, src, from)                                                              \
+    _Generic((dst),                                                                                \
+        PointBlock *: copyBlockPoint((PointBlock *)(dst), to, (PointBlock *)(src), from),          \
+        default: (void)((dst)[to] = (src)[from]))
+
+#if defined(HALF_STORAGE)
+
+float getPositionX(u32 p) {
+    return decodePosition(pts.cellsX[p], pts.positionsX[p], worldSize.x / 2);
+}
+float getPositionY(u32 p) {
+    return decodePosition(pts.cellsY[p], pts.positionsY[p], worldSize.y / 2);
+}
+float getSpeedX(u32 p) { return _cvtsh_ss(pts.speedsX[p]); }
+float getSpeedY(u32 p) { return _cvtsh_ss(pts.speedsY[p]); }
+
+void setPositionX(u32 p, float x) {
+    encodePosition(x, worldSize.x / 2, partitionsX, &pts.cellsX[p], &pts.positionsX[p]);
+}
+void setPositionY(u32 p, float y) {
+    encodePosition(y, worldSize.y / 2, partitionsY, &pts.cellsY[p], &pts.positionsY[p]);
+}
+void setSpeedX(u32 p, float speed) { pts.speedsX[p] = _cvtss_sh(speed, _MM_FROUND_TO_NEAREST_INT); }
+void setSpeedY(u32 p, float speed) { pts.speedsY[p] = _cvtss_sh(speed, _MM_FROUND_TO_NEAREST_INT); }
+
+__m256 loadPositionsX(u32 i) {
+    return decodePositions(&pts.cellsX[i], &pts.positionsX[i], worldSize.x / 2);
+}
+__m256 loadPositionsY(u32 i) {
+    return decodePositions(&pts.cellsY[i], &pts.positionsY[i], worldSize.y / 2);
+}
+__m256 loadSpeedsX(u32 i) { return _mm256_cvtph_ps(_mm_load_si128((__m128i *)&pts.speedsX[i])); }
+__m256 loadSpeedsY(u32 i) { return _mm256_cvtph_ps(_mm_load_si128((__m128i *)&pts.speedsY[i])); }
+
+void storePositionsX(u32 i, __m256 x) {
+    encodePositions(x, worldSize.x / 2, partitionsX, &pts.cellsX[i], &pts.positionsX[i]);
+}
+void storePositionsY(u32 i, __m256 y) {
+    encodePositions(y, worldSize.y / 2, partitionsY, &pts.cellsY[i], &pts.positionsY[i]);
+}
+void storeSpeedsX(u32 i, __m256 speeds) {
+    _mm_store_si128((__m128i *)&pts.speedsX[i], _mm256_cvtps_ph(speeds, _MM_FROUND_TO_NEAREST_INT));
+}
+void storeSpeedsY(u32 i, __m256 speeds) {
+    _mm_store_si128((__m128i *)&pts.speedsY[i], _mm256_cvtps_ph(speeds, _MM_FROUND_TO_NEAREST_INT));
+}
+
+float getRadius(u32 p) { return pts.radiuses[p]; }
+void setRadius(u32 p, float radius) { pts.radiuses[p] = radius; }
+__m256 loadRadiuses(u32 i) { return _mm256_load_ps(&pts.radiuses[i]); }
+
+#elif defined(AOSOA_LAYOUT)
+
+// Particle p is lane p % 8 of block p / 8, so 8 particles starting at a multiple of 8 are one
+// aligned vector of each block
+#define LANE(field, p) pts.blocks[(p) >> 3].field[(p) & 7]
+
+float getPositionX(u32 p) { return LANE(positionsX, p); }
+float getPositionY(u32 p) { return LANE(positionsY, p); }
+float getSpeedX(u32 p) { return LANE(speedsX, p); }
+float getSpeedY(u32 p) { return LANE(speedsY, p); }
+float getRadius(u32 p) { return LANE(radiuses, p); }
+
+void setPositionX(u32 p, float x) { LANE(positionsX, p) = x; }
+void setPositionY(u32 p, float y) { LANE(positionsY, p) = y; }
+void setSpeedX(u32 p, float speed) { LANE(speedsX, p) = speed; }
+void setSpeedY(u32 p, float speed) { LANE(speedsY, p) = speed; }
+void setRadius(u32 p, float radius) { LANE(radiuses, p) = radius; }
+
+__m256 loadPositionsX(u32 i) { return _mm256_load_ps(pts.blocks[i >> 3].positionsX); }
+__m256 loadPositionsY(u32 i) { return _mm256_load_ps(pts.blocks[i >> 3].positionsY); }
+__m256 loadSpeedsX(u32 i) { return _mm256_load_ps(pts.blocks[i >> 3].speedsX); }
+__m256 loadSpeedsY(u32 i) { return _mm256_load_ps(pts.blocks[i >> 3].speedsY); }
+__m256 loadRadiuses(u32 i) { return _mm256_load_ps(pts.blocks[i >> 3].radiuses); }
+
+void storePositionsX(u32 i, __m256 x) { _mm256_store_ps(pts.blocks[i >> 3].positionsX, x); }
+void storePositionsY(u32 i, __m256 y) { _mm256_store_ps(pts.blocks[i >> 3].positionsY, y); }
+void storeSpeedsX(u32 i, __m256 speeds) { _mm256_store_ps(pts.blocks[i >> 3].speedsX, speeds); }
+void storeSpeedsY(u32 i, __m256 speeds) { _mm256_store_ps(pts.blocks[i >> 3].speedsY, speeds); }
+
+#else
+
+float getPositionX(u32 p) { return pts.positionsX[p]; }
+float getPositionY(u32 p) { return pts.positionsY[p]; }
+float getSpeedX(u32 p) { return pts.speedsX[p]; }
+float getSpeedY(u32 p) { return pts.speedsY[p]; }
+
+void setPositionX(u32 p, float x) { pts.positionsX[p] = x; }
+void setPositionY(u32 p, float y) { pts.positionsY[p] = y; }
+void setSpeedX(u32 p, float speed) { pts.speedsX[p] = speed; }
+void setSpeedY(u32 p, float speed) { pts.speedsY[p] = speed; }
+
+__m256 loadPositionsX(u32 i) { return _mm256_load_ps(&pts.positionsX[i]); }
+__m256 loadPositionsY(u32 i) { return _mm256_load_ps(&pts.positionsY[i]); }
+__m256 loadSpeedsX(u32 i) { return _mm256_load_ps(&pts.speedsX[i]); }
+__m256 loadSpeedsY(u32 i) { return _mm256_load_ps(&pts.speedsY[i]); }
+
+void storePositionsX(u32 i, __m256 x) { _mm256_store_ps(&pts.positionsX[i], x); }
+void storePositionsY(u32 i, __m256 y) { _mm256_store_ps(&pts.positionsY[i], y); }
+void storeSpeedsX(u32 i, __m256 speeds) { _mm256_store_ps(&pts.speedsX[i], speeds); }
+void storeSpeedsY(u32 i, __m256 speeds) { _mm256_store_ps(&pts.speedsY[i], speeds); }
+
+float getRadius(u32 p) { return pts.radiuses[p]; }
+void setRadius(u32 p, float radius) { pts.radiuses[p] = radius; }
+__m256 loadRadiuses(u32 i) { return _mm256_load_ps(&pts.radiuses[i]); }
+
+#endif
+
+#ifdef HALF_STORAGE
+
+// The cells are stored, binning does not need to look at the positions
+int pointColumn(u32 p) { return pts.cellsX[p]; }
+int pointRow(u32 p) { return pts.cellsY[p]; }
+
+__m256i loadColumns(u32 i) {
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)&pts.cellsX[i]));
+}
+__m256i loadRows(u32 i) {
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)&pts.cellsY[i]));
+}
+
+#else
+
+int pointColumn(u32 p) {
+    return clampCell(floorf((getPositionX(p) + worldSize.x / 2) / PARTITION_SIZE), partitionsX);
+}
+int pointRow(u32 p) {
+    return clampCell(floorf((getPositionY(p) + worldSize.y / 2) / PARTITION_SIZE), partitionsY);
+}
+
+// The world is centered on the origin, shift it so that cell (0, 0) is its top left corner
+__m256i cellsOf(__m256 positions, float half, int cells) {
+    __m256 shifted = _mm256_add_ps(positions, _mm256_set1_ps(half));
+    __m256i cell = _mm256_cvttps_epi32(
+        _mm256_floor_ps(_mm256_div_ps(shifted, _mm256_set1_ps(PARTITION_SIZE))));
+    return _mm256_min_epi32(_mm256_max_epi32(cell, _mm256_setzero_si256()),
+                            _mm256_set1_epi32(cells - 1));
+}
+
+__m256i loadColumns(u32 i) { return cellsOf(loadPositionsX(i), worldSize.x / 2, partitionsX); }
+__m256i loadRows(u32 i) { return cellsOf(loadPositionsY(i), worldSize.y / 2, partitionsY); }
+
+#endif
+
+// The arrays always hold a whole number of vectors: particles [amount, paddedAmount()) are inert
+// sentinels, with no speed and no radius and parked outside the world, so kernels never need a
+// scalar tail. They are never binned, and padPoints() writes them again whenever amount changes.
+u32 paddedAmount() { return (pts.amount + 7) & ~7u; }
+
+void padPoints() {
+    for (u32 p = pts.amount; p < paddedAmount(); p++) {
+        setPositionX(p, worldSize.x), setPositionY(p, worldSize.y);
+        setSpeedX(p, 0), setSpeedY(p, 0);
+        setRadius(p, 0), pts.colors[p] = 0;
+    }
+}
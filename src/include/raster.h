@@ -0,0 +1,17 @@
+#pragma once
+
+#include <raylib.h>
+#include <stdio.h>
+
+#include "types.h"
+
+// Frame drawn on the CPU, RGBA8 (r in the low byte), row after row
+typedef struct {
+    u32 *pixels;
+    int width, height;
+} Canvas;
+
+Camera2D fitWorldCamera(int width, int height);
+void rasterizeParticles(Canvas *canvas, Camera2D camera);
+bool writePpmImage(FILE *file, const Canvas *canvas);
+bool writePpm(const Canvas *canvas, const char *path);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <raylib.h>
+
+#include "types.h"
+
+// How the world pass draws the particles
+typedef enum {
+    // One DrawTexturePro() per particle through raylib's batch
+    RENDER_TEXTURES,
+    // Every particle in one instanced draw call, the streams of Points are the instance data
+    RENDER_INSTANCED,
+    // Every particle as two triangles of a vertex buffer built with AVX2, one draw call
+    RENDER_QUADS,
+    RENDER_MODES
+} RenderMode;
+
+static const char *renderModeNames[RENDER_MODES] = {"textures", "instanced", "quads"};
+// Size of the window, only the windowed build has one
+static int w, h;
+
+void initRenderer(Texture2D circle, const Color *palette);
+void savePositions();
+void interpolatePositions(float alpha);
+u32 drawParticles(Camera2D camera);
+void closeRenderer();
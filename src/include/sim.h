@@ -2,4 +2,19 @@
 
 #include "types.h"
 
+#define SIM_USAGE                                                                                  \
+    "[--particles N] [--threads N] [--deterministic] [--task-graph] [--jacobi] [--half-error] "    \
+    "[--pin] [--numa] [--numa-report]"
+
+bool parseSimArg(int argc, char **argv, int *i);
+void initSimulation();
+
+void reservePoints(u32 needed);
+void clearPoints();
+void spawnPoints(u32 count);
+void generatePoints();
 void updateParticles();
+
+u32 removePointsAt(const u32 *indices, u32 count);
+u32 removePointsIf(bool (*predicate)(u32 p, void *ctx), void *ctx);
+u32 removePointsInRect(Rectangle region);
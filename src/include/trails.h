@@ -0,0 +1,11 @@
+#pragma once
+
+#include <raylib.h>
+
+#include "types.h"
+
+void setTrailSamples(u32 samples);
+void initTrails();
+void closeTrails();
+void updateTrails();
+void drawTrails(Camera2D camera);
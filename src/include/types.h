@@ -12,30 +12,103 @@
 #define i16 int16_t
 #define i8 int8_t
 
-#define MAX_PARTICLES 20480 * 8
 #define NUM_THREADS 8
+#define MAX_THREADS 64
 
 #define POINTS_ADDED 2048 * 8
+#define PALETTE_SIZE 10
 
 #define BASE_SIZE 0.2
 #define MAX_SPEED 100
 #define TARGET_FPS 60
+// Below this zoom the world pass draws the density of the grid cells instead of the particles
+#define DENSITY_LOD_ZOOM 0.75f
+// The software rasterizer works on square tiles of this many pixels, one job each
+#define RASTER_TILE 64
+// Frames an export can hold waiting for the disk, the render loop drops frames past this
+#define EXPORT_SLOTS 8
+// Longest motion trail, in positions kept per particle
+#define TRAIL_MAX_SAMPLES 32
 
 #define SPACE_PARTITIONS 256
-#define MAX_PARTITION_PARTICLES (MAX_PARTICLES / SPACE_PARTITIONS)
+// A cell (and each of its spill chunks) is one cache line
+#define PARTITION_CHUNK_POINTS 13
+#define SPILL_SLAB_CHUNKS 1024
+// Frames between two trims of the spill pool
+#define SPILL_TRIM_FRAMES 64
 
-// Partition based collision detection
-typedef struct {
+// Deterministic mode always splits the grid into this many column stripes, whatever the thread
+// count, so contacts are resolved in the same order on every run.
+#define DETERMINISTIC_STRIPES 64
+#define DEFAULT_SEED 0x5eed
+
+// Stripes per thread when the step runs as a task graph, more stripes give more overlap
+#define GRAPH_STRIPES_PER_THREAD 4
+
+// Partition based collision detection. Particles that do not fit in a cell go to spill chunks of
+// the same layout, chained after it and taken from spillPool.
+typedef struct Partition {
     u32 amount;
-    u32 points[MAX_PARTITION_PARTICLES];
+    u32 points[PARTITION_CHUNK_POINTS];
+    struct Partition *next;
 } Partition;
 
+// 8 particles of the AoSoA layout, everything the collisions read about them in 5 vectors
 typedef struct {
-    float *speedsX;
-    float *speedsY;
-    float *positionsX;
-    float *positionsY;
-    float *radiuses;
+    _Alignas(32) float positionsX[8];
+    float positionsY[8];
+    float speedsX[8];
+    float speedsY[8];
+    float radiuses[8];
+} PointBlock;
+
+// Every array of Points as X(type, name). Code that has to move particles around (growing,
+// sorting, removing) goes through this list so that no array gets forgotten. Positions, speeds
+// and radiuses are only read and written through the accessors of points.h.
+//
+// With -DHALF_STORAGE speeds are fp16 and positions are u16 fixed point relative to the cell the
+// particle is in, which is kept in cellsX/cellsY: 10 bytes per particle for both instead of 16.
+// With -DAOSOA_LAYOUT they are interleaved in blocks of 8 particles instead.
+#if defined(HALF_STORAGE) && defined(AOSOA_LAYOUT)
+#error "HALF_STORAGE and AOSOA_LAYOUT can not be combined"
+#endif
+
+#ifdef HALF_STORAGE
+#define POINTS_STREAMS(X)                                                                          \
+    X(u16, speedsX)                                                                                \
+    X(u16, speedsY)                                                                                \
+    X(u16, positionsX)                                                                             \
+    X(u16, positionsY)                                                                             \
+    X(u8, cellsX)                                                                                  \
+    X(u8, cellsY)                                                                                  \
+    X(float, radiuses)                                                                             \
+    X(u8, colors)
+#elif defined(AOSOA_LAYOUT)
+#define POINTS_STREAMS(X)                                                                          \
+    X(PointBlock, blocks)                                                                          \
+    X(u8, colors)
+#else
+#define POINTS_STREAMS(X)                                                                          \
+    X(float, speedsX)                                                                              \
+    X(float, speedsY)                                                                              \
+    X(float, positionsX)                                                                           \
+    X(float, positionsY)                                                                           \
+    X(float, radiuses)                                                                             \
+    X(u8, colors)
+#endif
+
+// Particles per element of an array, and elements needed for `count` particles
+#define POINTS_PER(type) _Generic((type *)0, PointBlock *: 8, default: 1)
+#define STREAM_LENGTH(type, count) (((count) + POINTS_PER(type) - 1) / POINTS_PER(type))
+
+typedef struct {
+#define X(type, name) type *name;
+    POINTS_STREAMS(X)
+#undef X
     u32 amount;
-    u8 *colors;
+    u32 capacity;
+
+    // All the arrays live in this one block of the particle arena
+    u8 *block;
+    u64 blockSize;
 } Points;
@@ -1,88 +1,105 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 
 #include "raylib.h"
+#include "rlgl.h"
 
+#include "./include/bench.h"
+#include "./include/export.h"
 #include "./include/gui.h"
+#include "./include/jobs.h"
 #include "./include/memory.h"
+#include "./include/points.h"
 #include "./include/types.h"
 
 #include "./include/globals.h"
+#include "./include/domain.h"
+#include "./include/raster.h"
+#include "./include/render.h"
 #include "./include/sim.h"
+#include "./include/trails.h"
 
 #include "sim.c"
-
-Color colors[10] = {};
-
-void allocPoints() {
-    pts.speedsX = (float *)alloc(tempStorage, 32, sizeof(float) * MAX_PARTICLES);
-    pts.speedsY = (float *)alloc(tempStorage, 32, sizeof(float) * MAX_PARTICLES);
-    pts.positionsX = (float *)alloc(tempStorage, 32, sizeof(float) * MAX_PARTICLES);
-    pts.positionsY = (float *)alloc(tempStorage, 32, sizeof(float) * MAX_PARTICLES);
-    pts.radiuses = (float *)alloc(tempStorage, 32, sizeof(float) * MAX_PARTICLES);
-    pts.colors = (u8 *)alloc(tempStorage, 32, sizeof(u8) * MAX_PARTICLES);
-}
-
-void clearPoints() {
-    freeBumpAllocator(tempStorage);
-    pts.amount = 0;
-    memset(parts, 0, SPACE_PARTITIONS * SPACE_PARTITIONS * sizeof(Partition));
+#include "domain.c"
+#include "render.c"
+#include "raster.c"
+#include "export.c"
+#include "trails.c"
+#include "bench.c"
+
+static u32 procs;
+static u32 steps = 600;
+static const char *recordPath;
+// Fixed steps per second, 0 for one step of the frame time per frame
+static u32 simRate;
+// Frames per configuration of the render benchmark, 0 to run normally
+static u32 benchFrames;
+
+void usage(const char *program) {
+    printf("Usage: %s " SIM_USAGE " [--render textures|instanced|quads] [--no-lod] "
+           "[--record FILE.y4m|ppm] [--sim-rate HZ] [--trails N] [--bench-render FRAMES] "
+           "[--procs N [--steps N]]\n",
+           program);
+    exit(1);
 }
 
-void generatePoints() {
-    if (unlikely(pts.amount == 0)) {
-        allocPoints();
-    } else if (unlikely(pts.amount >= MAX_PARTICLES)) {
-        printf("Too many particles\n");
-        return;
+void parseArgs(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (parseSimArg(argc, argv, &i)) continue;
+
+        if (!strcmp(argv[i], "--render") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            int m = 0;
+            while (m < RENDER_MODES && strcmp(mode, renderModeNames[m])) m++;
+            if (m == RENDER_MODES) usage(argv[0]);
+            renderer.mode = m;
+        } else if (!strcmp(argv[i], "--no-lod")) {
+            renderer.lod = false;
+        } else if (!strcmp(argv[i], "--procs") && i + 1 < argc) {
+            procs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--steps") && i + 1 < argc) {
+            steps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (!strcmp(argv[i], "--sim-rate") && i + 1 < argc) {
+            int rate = atoi(argv[++i]);
+            if (rate <= 0) usage(argv[0]);
+            simRate = rate;
+        } else if (!strcmp(argv[i], "--trails") && i + 1 < argc) {
+            setTrailSamples(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--bench-render") && i + 1 < argc) {
+            benchFrames = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
     }
+}
 
-    const int end = pts.amount + POINTS_ADDED;
-    for (int i = pts.amount; i < end; ++i) {
-        u8 r = BASE_SIZE + GetRandomValue(3, 4);
-
-        pts.positionsX[i] = (float)GetRandomValue(-worldSize.x / 2 + r, worldSize.x / 2 - r);
-        pts.positionsY[i] = (float)GetRandomValue(-worldSize.y / 2 + r, worldSize.y / 2 - r);
-
-        pts.speedsX[i] = (float)GetRandomValue(-MAX_SPEED, MAX_SPEED);
-        pts.speedsY[i] = (float)GetRandomValue(-MAX_SPEED, MAX_SPEED);
-
-        pts.radiuses[i] = r;
-        pts.colors[i] = GetRandomValue(0, 10);
-    }
+int main(int argc, char **argv) {
+    parseArgs(argc, argv);
 
-    pts.amount += POINTS_ADDED;
-}
+    initSimulation();
 
-int main(void) {
-    // https://coolors.co/palette/001219-005f73-0a9396-94d2bd-e9d8a6-ee9b00-ca6702-bb3e03-ae2012-9b2226
-    colors[0] = GetColor(0x001219ff);
-    colors[1] = GetColor(0x005f73ff);
-    colors[2] = GetColor(0x0a9396ff);
-    colors[3] = GetColor(0x94d2bdff);
-    colors[4] = GetColor(0xe9d8a6ff);
-    colors[5] = GetColor(0xee9b00ff);
-    colors[6] = GetColor(0xca6702ff);
-    colors[7] = GetColor(0xbb3e03ff);
-    colors[8] = GetColor(0xae2012ff);
-    colors[9] = GetColor(0x9b2226ff);
-
-    tempStorage = NewBumpAlloc(MB(50));
-    if (!tempStorage) {
-        printf("Failed to init bump allocator\n");
-        crash();
-    }
+    // Split in slabs over several processes, runs for a fixed amount of steps without a window
+    if (procs > 0) return runDomains(procs, steps, initialPoints);
 
     InitWindow(1280, 720, "RayLib playground");
     SetTargetFPS(TARGET_FPS);
 
     w = GetScreenWidth(), h = GetScreenHeight();
-    PARTITION_SIZE = worldSize.x / SPACE_PARTITIONS;
+
+    initJobs(numThreads);
+    if (deterministic) {
+        // Same seed and step size on every run, the frame time would make runs diverge otherwise
+        SetRandomSeed(DEFAULT_SEED);
+        printf("Deterministic mode, %u threads\n", numThreads);
+    }
 
     Vector2 bSize = {100, 40};
     Vector2 center = {worldSize.x / 2, worldSize.y / 2};
     Camera2D camera = {.offset = w / 2, h / 2, .zoom = 1};
 
-    generatePoints();
+    spawnPoints(initialPoints);
 
     Image circleImg = LoadImage("assets/white-circle-no-outline.png");
     ImageMipmaps(&circleImg);
@@ -90,12 +107,42 @@ int main(void) {
     // SetTextureFilter(circleTex, TEXTURE_FILTER_BILINEAR);
     UnloadImage(circleImg);
 
+    // Measures the world pass instead of running, see benchmarkRender()
+    if (benchFrames) {
+        benchmarkRender(circleTex, benchFrames);
+        CloseWindow();
+        shutdownJobs();
+        return 0;
+    }
+
+    initRenderer(circleTex, colors);
+    initTrails();
+    if (recordPath && !startExport(recordPath, w, h, TARGET_FPS)) recordPath = 0;
+
     char dtString[14];
+    float stepClock = 0;
     while (!WindowShouldClose()) {
         Vector2 mousePos = GetMousePosition();
-        dt = GetFrameTime();
-
-        updateParticles();
+        float frameTime = deterministic ? 1.0f / TARGET_FPS : GetFrameTime();
+
+        if (simRate) {
+            // As many fixed steps as the frame time covers, at most a quarter second of them after
+            // a stall (or one step when a step is longer). The world pass draws the particles the
+            // leftover fraction of a step past the positions before the last one.
+            dt = 1.0f / simRate;
+            stepClock = fminf(stepClock + frameTime, fmaxf(0.25f, dt));
+            while (stepClock >= dt) {
+                savePositions();
+                updateParticles();
+                updateTrails();
+                stepClock -= dt;
+            }
+            interpolatePositions(stepClock / dt);
+        } else {
+            dt = frameTime;
+            updateParticles();
+            updateTrails();
+        }
 
         { // Camera controls
             // zoom
@@ -128,26 +175,17 @@ int main(void) {
             if (IsMouseButtonReleased(MOUSE_MIDDLE_BUTTON)) { startX = 0, startY = 0; }
         }
 
+        // Holding the right button drains the particles around the cursor
+        if (IsMouseButtonDown(MOUSE_RIGHT_BUTTON)) {
+            Vector2 at = GetScreenToWorld2D(mousePos, camera);
+            removePointsInRect((Rectangle){at.x - 50, at.y - 50, 100, 100});
+        }
+
         BeginDrawing();
         ClearBackground(RAYWHITE);
         BeginMode2D(camera);
-        { // WORLD_PASS
-            Vector2 origin = {0, 0};
-            Rectangle src = {0, 0, circleTex.width, circleTex.height};
-            for (int i = 0; i < pts.amount / 2; i += 2) {
-                // Basic loop unrolling
-                float posX1 = pts.positionsX[i], posY1 = pts.positionsY[i],
-                      radius1 = pts.radiuses[i];
-                float posX2 = pts.positionsX[i + 1], posY2 = pts.positionsY[i + 1],
-                      radius2 = pts.radiuses[i + 1];
-
-                Rectangle dest1 = {posX1 - radius1, posY1 - radius1, radius1 * 2, radius1 * 2};
-                Rectangle dest2 = {posX2 - radius2, posY2 - radius2, radius2 * 2, radius2 * 2};
-
-                DrawTexturePro(circleTex, src, dest1, origin, 0, colors[pts.colors[i]]);
-                DrawTexturePro(circleTex, src, dest2, origin, 0, colors[pts.colors[i + 1]]);
-            }
-        }
+        drawTrails(camera);
+        drawParticles(camera); // WORLD_PASS
         EndMode2D();
 
         { // UI pass
@@ -170,10 +208,25 @@ int main(void) {
             }
         }
 
+        // Export: the frame is read back before the swap, the disk is left to the writer thread
+        Canvas *frame = recordPath ? exportSlot() : 0;
+        if (frame) {
+            rlDrawRenderBatchActive();
+            u8 *pixels = rlReadScreenPixels(w, h);
+            memcpy(frame->pixels, pixels, (u64)w * h * 4);
+            RL_FREE(pixels);
+            publishExportSlot();
+        }
+
         EndDrawing();
     }
 
+    if (recordPath) finishExport();
+    closeTrails();
+    closeRenderer();
     CloseWindow();
+    shutdownJobs();
+    reportMemory();
 
     return 0;
 }
@@ -0,0 +1,261 @@
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "./include/globals.h"
+#include "./include/jobs.h"
+#include "./include/memory.h"
+#include "./include/points.h"
+#include "./include/raster.h"
+#include "./include/types.h"
+
+// One frame being rasterized. Each chunk of particles bins its discs to the tiles they touch and
+// the chunks are laid out in order, so every tile draws its particles by increasing index
+// whatever the number of threads, and frames are the same from one run to the other.
+typedef struct {
+    Canvas *canvas;
+    Camera2D camera;
+    int tilesX, tilesY, tiles;
+    u32 chunks;
+
+    // Disc of every particle in pixels
+    float *centersX, *centersY, *radiuses;
+    // [chunk][tile] discs of the chunk in the tile, then where the chunk writes them
+    u32 *chunkTiles;
+    // Discs of tile t are tileParticles[tileStart[t] .. tileStart[t + 1]]
+    u32 *tileStart;
+    u32 *tileParticles;
+    // [thread][channel] float planes of the tile a thread draws
+    float *planes;
+
+    float palette[PALETTE_SIZE][3];
+} RasterFrame;
+
+static RasterFrame raster;
+
+// The whole world centered in the frame, as large as it fits
+Camera2D fitWorldCamera(int width, int height) {
+    float zoom = fminf(width / worldSize.x, height / worldSize.y);
+    return (Camera2D){.offset = {width / 2.0f, height / 2.0f}, .zoom = zoom};
+}
+
+// First particle of a chunk, on a vector boundary. The last chunk ends with the sentinels.
+u32 rasterChunk(u32 chunk) {
+    if (chunk >= raster.chunks) return paddedAmount();
+    return ((u64)pts.amount * chunk / raster.chunks) & ~7u;
+}
+
+// Tiles touched by the disc of particle p, false when it is off the canvas
+bool discTiles(u32 p, int *x0, int *y0, int *x1, int *y1) {
+    float x = raster.centersX[p], y = raster.centersY[p], r = raster.radiuses[p] + 0.5f;
+    float width = raster.canvas->width, height = raster.canvas->height;
+    if (r <= 0.5f || x + r < 0 || y + r < 0 || x - r >= width || y - r >= height) return false;
+
+    *x0 = fmaxf(x - r, 0) / RASTER_TILE, *x1 = fminf(x + r, width - 1) / RASTER_TILE;
+    *y0 = fmaxf(y - r, 0) / RASTER_TILE, *y1 = fminf(y + r, height - 1) / RASTER_TILE;
+    return true;
+}
+
+// Moves the particles of a chunk to screen space (the camera is never rotated) and counts the
+// discs it sends to each tile
+void countTiles(void *ctx, u32 chunk, u32 thread) {
+    u32 begin = rasterChunk(chunk), end = rasterChunk(chunk + 1);
+    Camera2D camera = raster.camera;
+
+    const __m256 zoom = _mm256_set1_ps(camera.zoom);
+    const __m256 shiftX = _mm256_set1_ps(camera.offset.x - camera.target.x * camera.zoom);
+    const __m256 shiftY = _mm256_set1_ps(camera.offset.y - camera.target.y * camera.zoom);
+    for (u32 i = begin; i < end; i += 8) {
+        _mm256_store_ps(&raster.centersX[i], _mm256_fmadd_ps(loadPositionsX(i), zoom, shiftX));
+        _mm256_store_ps(&raster.centersY[i], _mm256_fmadd_ps(loadPositionsY(i), zoom, shiftY));
+        _mm256_store_ps(&raster.radiuses[i], _mm256_mul_ps(loadRadiuses(i), zoom));
+    }
+
+    u32 *counts = &raster.chunkTiles[chunk * raster.tiles];
+    memset(counts, 0, raster.tiles * sizeof(u32));
+    if (end > pts.amount) end = pts.amount;
+    for (u32 p = begin; p < end; p++) {
+        int x0, y0, x1, y1;
+        if (!discTiles(p, &x0, &y0, &x1, &y1)) continue;
+
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) counts[y * raster.tilesX + x]++;
+        }
+    }
+}
+
+void scatterTiles(void *ctx, u32 chunk, u32 thread) {
+    u32 begin = rasterChunk(chunk), end = rasterChunk(chunk + 1);
+    u32 *at = &raster.chunkTiles[chunk * raster.tiles];
+
+    if (end > pts.amount) end = pts.amount;
+    for (u32 p = begin; p < end; p++) {
+        int x0, y0, x1, y1;
+        if (!discTiles(p, &x0, &y0, &x1, &y1)) continue;
+
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) raster.tileParticles[at[y * raster.tilesX + x]++] = p;
+        }
+    }
+}
+
+// Blends one anti-aliased disc into the color planes of a tile, 8 pixels of a row at a time.
+// Coverage is how much of the pixel's distance to the center is inside the radius, clamped to
+// [0, 1], so the edge fades over one pixel.
+void drawDisc(float *planes[3], float x, float y, float r, const float color[3]) {
+    int x0 = fmaxf(floorf(x - r - 0.5f), 0), x1 = fminf(floorf(x + r + 0.5f), RASTER_TILE - 1);
+    int y0 = fmaxf(floorf(y - r - 0.5f), 0), y1 = fminf(floorf(y + r + 0.5f), RASTER_TILE - 1);
+
+    const __m256 lanes = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1);
+    const __m256 edge = _mm256_set1_ps(r + 0.5f);
+    const __m256 centerX = _mm256_set1_ps(x);
+    const __m256 red = _mm256_set1_ps(color[0]), green = _mm256_set1_ps(color[1]),
+                 blue = _mm256_set1_ps(color[2]);
+
+    for (int span = x0; span <= x1; span += 8) {
+        // Spans never leave the tile, the lanes a span shares with the previous one are masked
+        int start = span < RASTER_TILE - 8 ? span : RASTER_TILE - 8;
+        __m256 pixels = _mm256_add_ps(_mm256_set1_ps(start), lanes);
+        __m256 inside = _mm256_and_ps(_mm256_cmp_ps(pixels, _mm256_set1_ps(span), _CMP_GT_OQ),
+                                      _mm256_cmp_ps(pixels, _mm256_set1_ps(x1 + 1), _CMP_LT_OQ));
+        __m256 dx = _mm256_sub_ps(pixels, centerX);
+        __m256 dx2 = _mm256_mul_ps(dx, dx);
+
+        for (int row = y0; row <= y1; row++) {
+            float dy = row + 0.5f - y;
+            __m256 distance = _mm256_sqrt_ps(_mm256_add_ps(dx2, _mm256_set1_ps(dy * dy)));
+            __m256 coverage = _mm256_sub_ps(edge, distance);
+            coverage = _mm256_and_ps(_mm256_min_ps(_mm256_max_ps(coverage, zero), one), inside);
+
+            u32 at = row * RASTER_TILE + start;
+            __m256 r = _mm256_loadu_ps(&planes[0][at]);
+            __m256 g = _mm256_loadu_ps(&planes[1][at]);
+            __m256 b = _mm256_loadu_ps(&planes[2][at]);
+            _mm256_storeu_ps(&planes[0][at], _mm256_fmadd_ps(_mm256_sub_ps(red, r), coverage, r));
+            _mm256_storeu_ps(&planes[1][at], _mm256_fmadd_ps(_mm256_sub_ps(green, g), coverage, g));
+            _mm256_storeu_ps(&planes[2][at], _mm256_fmadd_ps(_mm256_sub_ps(blue, b), coverage, b));
+        }
+    }
+}
+
+// Packs the planes of a tile to RGBA8 in the canvas, masking the columns past its right edge
+void storeTile(float *planes[3], int tileX, int tileY) {
+    Canvas *canvas = raster.canvas;
+    int width = canvas->width - tileX < RASTER_TILE ? canvas->width - tileX : RASTER_TILE;
+    int height = canvas->height - tileY < RASTER_TILE ? canvas->height - tileY : RASTER_TILE;
+
+    const __m256i opaque = _mm256_set1_epi32(0xff000000);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for (int row = 0; row < height; row++) {
+        for (int x = 0; x < width; x += 8) {
+            u32 at = row * RASTER_TILE + x;
+            __m256i r = _mm256_cvtps_epi32(_mm256_load_ps(&planes[0][at]));
+            __m256i g = _mm256_cvtps_epi32(_mm256_load_ps(&planes[1][at]));
+            __m256i b = _mm256_cvtps_epi32(_mm256_load_ps(&planes[2][at]));
+            __m256i rgba = _mm256_or_si256(
+                _mm256_or_si256(r, _mm256_slli_epi32(g, 8)),
+                _mm256_or_si256(_mm256_slli_epi32(b, 16), opaque));
+
+            __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(width - x), lanes);
+            u32 *out = &canvas->pixels[(u64)(tileY + row) * canvas->width + tileX + x];
+            _mm256_maskstore_epi32((int *)out, mask, rgba);
+        }
+    }
+}
+
+void drawTile(void *ctx, u32 tile, u32 thread) {
+    float *planes[3];
+    for (int c = 0; c < 3; c++) {
+        planes[c] = &raster.planes[(thread * 3 + c) * RASTER_TILE * RASTER_TILE];
+    }
+
+    const __m256 background = _mm256_set1_ps(RAYWHITE.r);
+    for (int c = 0; c < 3; c++) {
+        for (u32 i = 0; i < RASTER_TILE * RASTER_TILE; i += 8) {
+            _mm256_store_ps(&planes[c][i], background);
+        }
+    }
+
+    int tileX = tile % raster.tilesX * RASTER_TILE, tileY = tile / raster.tilesX * RASTER_TILE;
+    for (u32 k = raster.tileStart[tile]; k < raster.tileStart[tile + 1]; k++) {
+        u32 p = raster.tileParticles[k];
+        drawDisc(planes, raster.centersX[p] - tileX, raster.centersY[p] - tileY,
+                 raster.radiuses[p], raster.palette[pts.colors[p]]);
+    }
+
+    storeTile(planes, tileX, tileY);
+}
+
+// Draws every particle as an anti-aliased disc over a RAYWHITE background, on the job pool:
+// particles are moved to screen space and binned to tiles in chunks, then every tile is drawn
+// on its own.
+void rasterizeParticles(Canvas *canvas, Camera2D camera) {
+    ArenaMark mark = getMark(renderArena);
+    u32 padded = paddedAmount();
+
+    raster.canvas = canvas;
+    raster.camera = camera;
+    raster.tilesX = (canvas->width + RASTER_TILE - 1) / RASTER_TILE;
+    raster.tilesY = (canvas->height + RASTER_TILE - 1) / RASTER_TILE;
+    raster.tiles = raster.tilesX * raster.tilesY;
+    raster.chunks = numThreads;
+    for (int c = 0; c < PALETTE_SIZE; c++) {
+        raster.palette[c][0] = colors[c].r, raster.palette[c][1] = colors[c].g;
+        raster.palette[c][2] = colors[c].b;
+    }
+
+    raster.centersX = (float *)alloc(renderArena, 32, padded * sizeof(float));
+    raster.centersY = (float *)alloc(renderArena, 32, padded * sizeof(float));
+    raster.radiuses = (float *)alloc(renderArena, 32, padded * sizeof(float));
+    raster.chunkTiles = (u32 *)alloc(renderArena, 32, raster.chunks * raster.tiles * sizeof(u32));
+    raster.tileStart = (u32 *)alloc(renderArena, 32, (raster.tiles + 1) * sizeof(u32));
+    runJobs(countTiles, 0, raster.chunks);
+
+    u32 total = 0;
+    for (int t = 0; t < raster.tiles; t++) {
+        raster.tileStart[t] = total;
+        for (u32 c = 0; c < raster.chunks; c++) {
+            u32 count = raster.chunkTiles[c * raster.tiles + t];
+            raster.chunkTiles[c * raster.tiles + t] = total;
+            total += count;
+        }
+    }
+    raster.tileStart[raster.tiles] = total;
+
+    raster.tileParticles = (u32 *)alloc(renderArena, 32, total * sizeof(u32));
+    raster.planes = (float *)alloc(renderArena, 32,
+                                   numThreads * 3 * RASTER_TILE * RASTER_TILE * sizeof(float));
+    runJobs(scatterTiles, 0, raster.chunks);
+    runJobs(drawTile, 0, raster.tiles);
+
+    restoreMark(renderArena, mark);
+}
+
+// Fails only when the row buffer can not be allocated, write errors are left on the file
+bool writePpmImage(FILE *file, const Canvas *canvas) {
+    u8 *row = (u8 *)malloc(canvas->width * 3);
+    if (!row) return false;
+
+    fprintf(file, "P6\n%d %d\n255\n", canvas->width, canvas->height);
+    for (int y = 0; y < canvas->height; y++) {
+        for (int x = 0; x < canvas->width; x++) {
+            u32 pixel = canvas->pixels[(u64)y * canvas->width + x];
+            row[x * 3] = pixel, row[x * 3 + 1] = pixel >> 8, row[x * 3 + 2] = pixel >> 16;
+        }
+        fwrite(row, 3, canvas->width, file);
+    }
+    free(row);
+    return true;
+}
+
+bool writePpm(const Canvas *canvas, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    bool written = writePpmImage(file, canvas) && !ferror(file);
+    return fclose(file) == 0 && written;
+}
@@ -0,0 +1,579 @@
+#include <raylib.h>
+#include <raymath.h>
+#include <rlgl.h>
+#include <stddef.h>
+
+#include "./include/globals.h"
+#include "./include/memory.h"
+#include "./include/points.h"
+#include "./include/render.h"
+#include "./include/types.h"
+
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+
+// The quad of a particle is expanded from its center and radius in the vertex shader, the
+// fragment shader only tints the circle texture. GLSL 330 is what rlgl's GL 3.3 backend runs.
+static const char *instancedVertexShader = //
+    "#version 330\n"
+    "in vec2 corner;\n"
+    "in float positionX;\n"
+    "in float positionY;\n"
+    "in float radius;\n"
+    "in float colorIndex;\n"
+    "uniform mat4 mvp;\n"
+    "uniform vec4 palette[" STRINGIFY(PALETTE_SIZE) "];\n"
+    "out vec2 uv;\n"
+    "out vec4 tint;\n"
+    "void main() {\n"
+    "    uv = corner;\n"
+    "    tint = palette[int(colorIndex)];\n"
+    "    vec2 at = vec2(positionX, positionY) + (corner * 2.0 - 1.0) * radius;\n"
+    "    gl_Position = mvp * vec4(at, 0.0, 1.0);\n"
+    "}\n";
+
+// Quads built on the CPU by buildQuads(), one QuadVertex per corner
+static const char *quadVertexShader = //
+    "#version 330\n"
+    "in vec2 vertexPosition;\n"
+    "in vec2 vertexTexCoord;\n"
+    "in vec4 vertexColor;\n"
+    "uniform mat4 mvp;\n"
+    "out vec2 uv;\n"
+    "out vec4 tint;\n"
+    "void main() {\n"
+    "    uv = vertexTexCoord;\n"
+    "    tint = vertexColor;\n"
+    "    gl_Position = mvp * vec4(vertexPosition, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *circleFragmentShader = //
+    "#version 330\n"
+    "in vec2 uv;\n"
+    "in vec4 tint;\n"
+    "uniform sampler2D circle;\n"
+    "out vec4 finalColor;\n"
+    "void main() { finalColor = texture(circle, uv) * tint; }\n";
+
+enum { STREAM_POSITIONS_X, STREAM_POSITIONS_Y, STREAM_RADIUSES, STREAM_COLORS, INSTANCE_STREAMS };
+
+// 16 bytes, two of them fill an AVX register. UVs and color are normalized by the GPU.
+typedef struct {
+    float x, y;
+    u8 u, v, pad[2];
+    Color color;
+} QuadVertex;
+
+// Two triangles per particle, corners in texture coordinates
+#define QUAD_VERTICES 6
+static const float quadCorners[QUAD_VERTICES * 2] = {0, 0, 0, 1, 1, 1, 0, 0, 1, 1, 1, 0};
+
+// One of our shaders and the vertex array it draws from
+struct {
+    Shader shader;
+    int mvpLoc, circleLoc;
+    u32 vao;
+} typedef CircleShader;
+
+// Triangles built on the CPU, drawn with the quad shader in one call
+struct {
+    CircleShader shader;
+    u32 vbo;
+    u32 capacity; // vertices the buffer has room for
+} typedef QuadBatch;
+
+// Positions, radiuses and colors of the particles to draw, padded to whole vectors
+typedef struct {
+    float *positionsX, *positionsY, *radiuses;
+    u8 *colors;
+} RenderStreams;
+
+struct {
+    RenderMode mode;
+    Texture2D circle;
+    const Color *palette;
+
+    CircleShader instanced;
+    int paletteLoc;
+    int streamLocs[INSTANCE_STREAMS];
+    u32 cornersVbo;
+    u32 streamVbos[INSTANCE_STREAMS];
+    // Particles the instance buffers have room for
+    u32 capacity;
+    QuadBatch quads;
+
+    // One texel per grid cell, drawn over the world when zoomed out
+    bool lod;
+    Texture2D density;
+
+    // Positions before the last step, and the ones drawn between them and the current ones (see
+    // interpolatePositions()), indexed like Points was at `savedVersion`
+    Arena *interpolation;
+    u32 interpolationCapacity;
+    float *previousX, *previousY, *drawnX, *drawnY;
+    u32 savedVersion;
+    bool saved, interpolated;
+} typedef Renderer;
+
+static Renderer renderer = {.mode = RENDER_INSTANCED, .lod = true};
+static Color densityPixels[SPACE_PARTITIONS * SPACE_PARTITIONS];
+
+void loadInstanceStream(int stream, u32 capacity) {
+    u32 size = stream == STREAM_COLORS ? sizeof(u8) : sizeof(float);
+    int type = stream == STREAM_COLORS ? RL_UNSIGNED_BYTE : RL_FLOAT;
+    int loc = renderer.streamLocs[stream];
+
+    renderer.streamVbos[stream] = rlLoadVertexBuffer(0, capacity * size, true);
+    rlSetVertexAttribute(loc, 1, type, false, 0, 0);
+    rlSetVertexAttributeDivisor(loc, 1);
+    rlEnableVertexAttribute(loc);
+}
+
+// The instance buffers follow the capacity of Points, they are only reallocated when it grows
+void reserveInstances(u32 capacity) {
+    if (capacity <= renderer.capacity) return;
+
+    rlEnableVertexArray(renderer.instanced.vao);
+    for (int s = 0; s < INSTANCE_STREAMS; s++) {
+        if (renderer.capacity) rlUnloadVertexBuffer(renderer.streamVbos[s]);
+        loadInstanceStream(s, capacity);
+    }
+    rlDisableVertexArray();
+    renderer.capacity = capacity;
+}
+
+// The vertex buffer of a batch is only reallocated when it grows
+void reserveQuadBatch(QuadBatch *batch, u32 vertices) {
+    if (vertices <= batch->capacity) return;
+
+    Shader shader = batch->shader.shader;
+    rlEnableVertexArray(batch->shader.vao);
+    if (batch->capacity) rlUnloadVertexBuffer(batch->vbo);
+    batch->vbo = rlLoadVertexBuffer(0, vertices * sizeof(QuadVertex), true);
+
+    int stride = sizeof(QuadVertex);
+    int position = GetShaderLocationAttrib(shader, "vertexPosition");
+    int texCoord = GetShaderLocationAttrib(shader, "vertexTexCoord");
+    int color = GetShaderLocationAttrib(shader, "vertexColor");
+    rlSetVertexAttribute(position, 2, RL_FLOAT, false, stride, offsetof(QuadVertex, x));
+    rlSetVertexAttribute(texCoord, 2, RL_UNSIGNED_BYTE, true, stride, offsetof(QuadVertex, u));
+    rlSetVertexAttribute(color, 4, RL_UNSIGNED_BYTE, true, stride, offsetof(QuadVertex, color));
+    rlEnableVertexAttribute(position);
+    rlEnableVertexAttribute(texCoord);
+    rlEnableVertexAttribute(color);
+    rlDisableVertexArray();
+    batch->capacity = vertices;
+}
+
+// raylib falls back to its default shader when ours does not compile
+bool loadCircleShader(CircleShader *circle, const char *vertexShader) {
+    circle->shader = LoadShaderFromMemory(vertexShader, circleFragmentShader);
+    if (circle->shader.id == rlGetShaderIdDefault()) return false;
+
+    circle->mvpLoc = GetShaderLocation(circle->shader, "mvp");
+    circle->circleLoc = GetShaderLocation(circle->shader, "circle");
+    circle->vao = rlLoadVertexArray();
+    return true;
+}
+
+void unloadCircleShader(CircleShader *circle) {
+    rlUnloadVertexArray(circle->vao);
+    UnloadShader(circle->shader);
+    *circle = (CircleShader){0};
+}
+
+bool loadQuadBatch(QuadBatch *batch) { return loadCircleShader(&batch->shader, quadVertexShader); }
+
+void unloadQuadBatch(QuadBatch *batch) {
+    if (!batch->shader.vao) return;
+    if (batch->capacity) rlUnloadVertexBuffer(batch->vbo);
+    unloadCircleShader(&batch->shader);
+    *batch = (QuadBatch){0};
+}
+
+bool initInstanced() {
+    if (!loadCircleShader(&renderer.instanced, instancedVertexShader)) return false;
+    Shader shader = renderer.instanced.shader;
+    renderer.paletteLoc = GetShaderLocation(shader, "palette");
+
+    const char *streams[INSTANCE_STREAMS] = {"positionX", "positionY", "radius", "colorIndex"};
+    for (int s = 0; s < INSTANCE_STREAMS; s++) {
+        renderer.streamLocs[s] = GetShaderLocationAttrib(shader, streams[s]);
+    }
+
+    int cornerLoc = GetShaderLocationAttrib(shader, "corner");
+    rlEnableVertexArray(renderer.instanced.vao);
+    renderer.cornersVbo = rlLoadVertexBuffer(quadCorners, sizeof(quadCorners), false);
+    rlSetVertexAttribute(cornerLoc, 2, RL_FLOAT, false, 0, 0);
+    rlEnableVertexAttribute(cornerLoc);
+    rlDisableVertexArray();
+    return true;
+}
+
+void initRenderer(Texture2D circle, const Color *palette) {
+    renderer.circle = circle;
+    renderer.palette = palette;
+
+    bool ready = renderer.mode == RENDER_INSTANCED ? initInstanced()
+                 : renderer.mode == RENDER_QUADS   ? loadQuadBatch(&renderer.quads)
+                                                   : true;
+    if (!ready) {
+        printf("Rendering %s is not available, drawing textures instead\n",
+               renderModeNames[renderer.mode]);
+        renderer.mode = RENDER_TEXTURES;
+    }
+    printf("Rendering: %s\n", renderModeNames[renderer.mode]);
+
+    if (renderer.lod) {
+        Image image = {densityPixels, partitionsX, partitionsY, 1,
+                       PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+        renderer.density = LoadTextureFromImage(image);
+        SetTextureFilter(renderer.density, TEXTURE_FILTER_BILINEAR);
+        trackStaticMemory(TAG_RENDER, sizeof(densityPixels));
+    }
+}
+
+// Color of a cell: the average color of the particles in its first chunk (at most
+// PARTITION_CHUNK_POINTS of them) and, as alpha, how much of the cell all of its particles would
+// cover, from the average radius of the same sample. The work is bounded per cell, whatever the
+// number of particles.
+Color cellDensity(Partition *part) {
+    u32 amount = partitionAmount(part);
+    if (!amount) return (Color){0};
+
+    float sum[3] = {0}, area = 0;
+    for (u32 k = 0; k < part->amount; k++) {
+        u32 p = part->points[k];
+        Color color = renderer.palette[pts.colors[p]];
+        sum[0] += color.r, sum[1] += color.g, sum[2] += color.b;
+        area += PI * getRadius(p) * getRadius(p);
+    }
+
+    float coverage = area / part->amount * amount / (PARTITION_SIZE * PARTITION_SIZE);
+    return (Color){sum[0] / part->amount, sum[1] / part->amount, sum[2] / part->amount,
+                   255 * (coverage < 1 ? coverage : 1)};
+}
+
+// Level of detail for low zooms: the grid is splatted to a texture of one texel per cell, which
+// is stretched over the world. Returns false when the grid can not be used this frame.
+bool drawDensity() {
+    if (!partitionsValid) return false;
+
+    for (int y = 0; y < partitionsY; y++) {
+        for (int x = 0; x < partitionsX; x++) {
+            densityPixels[y * partitionsX + x] = cellDensity(&parts[x][y]);
+        }
+    }
+    UpdateTexture(renderer.density, densityPixels);
+
+    Rectangle src = {0, 0, partitionsX, partitionsY};
+    Rectangle dest = {-worldSize.x / 2, -worldSize.y / 2, partitionsX * PARTITION_SIZE,
+                      partitionsY * PARTITION_SIZE};
+    DrawTexturePro(renderer.density, src, dest, (Vector2){0, 0}, 0, WHITE);
+    return true;
+}
+
+// Particles in the cells the camera sees, plus a ring of one cell for the particles that
+// overlap the border or moved since they were binned. Returns 0 when every particle has to be
+// drawn: the whole grid is on screen, or the grid is not usable (see partitionsValid).
+u32 *visiblePoints(Camera2D camera, u32 *count) {
+    if (!partitionsValid) return 0;
+
+    Vector2 topLeft = GetScreenToWorld2D((Vector2){0, 0}, camera);
+    Vector2 bottomRight = GetScreenToWorld2D((Vector2){w, h}, camera);
+    int x0 = clampCell(floorf((topLeft.x + worldSize.x / 2) / PARTITION_SIZE) - 1, partitionsX);
+    int y0 = clampCell(floorf((topLeft.y + worldSize.y / 2) / PARTITION_SIZE) - 1, partitionsY);
+    int x1 = clampCell(floorf((bottomRight.x + worldSize.x / 2) / PARTITION_SIZE) + 1, partitionsX);
+    int y1 = clampCell(floorf((bottomRight.y + worldSize.y / 2) / PARTITION_SIZE) + 1, partitionsY);
+    if (x0 == 0 && y0 == 0 && x1 == partitionsX - 1 && y1 == partitionsY - 1) return 0;
+
+    u32 visible = 0;
+    for (int x = x0; x <= x1; x++) {
+        for (int y = y0; y <= y1; y++) visible += partitionAmount(&parts[x][y]);
+    }
+
+    u32 *points = (u32 *)alloc(renderArena, 32, visible * sizeof(u32));
+    *count = 0;
+    for (int x = x0; x <= x1; x++) {
+        for (int y = y0; y <= y1; y++) {
+            for (Partition *chunk = &parts[x][y]; chunk; chunk = chunk->next) {
+                memcpy(&points[*count], chunk->points, chunk->amount * sizeof(u32));
+                *count += chunk->amount;
+            }
+        }
+    }
+    return points;
+}
+
+// Room for the saved and drawn positions of every particle. Saved positions do not survive
+// Points growing.
+void reserveInterpolation() {
+    if (renderer.interpolation && renderer.interpolationCapacity >= pts.capacity) return;
+    if (!renderer.interpolation) {
+        renderer.interpolation = NewVirtualArena(GB(1), false, TAG_RENDER);
+    }
+
+    resetArena(renderer.interpolation);
+    u64 bytes = pts.capacity * sizeof(float);
+    renderer.previousX = (float *)alloc(renderer.interpolation, 32, bytes);
+    renderer.previousY = (float *)alloc(renderer.interpolation, 32, bytes);
+    renderer.drawnX = (float *)alloc(renderer.interpolation, 32, bytes);
+    renderer.drawnY = (float *)alloc(renderer.interpolation, 32, bytes);
+    renderer.interpolationCapacity = pts.capacity;
+    renderer.saved = false;
+}
+
+// Called before every fixed step, keeps the positions the step starts from
+void savePositions() {
+    reserveInterpolation();
+    for (u32 i = 0; i < paddedAmount(); i += 8) {
+        _mm256_store_ps(&renderer.previousX[i], loadPositionsX(i));
+        _mm256_store_ps(&renderer.previousY[i], loadPositionsY(i));
+    }
+    renderer.saved = true;
+    renderer.savedVersion = pointsVersion;
+}
+
+// Positions drawn this frame, `alpha` of the way from the saved ones to the current ones. When
+// particles were added, removed or reordered since the save, the current ones are drawn as is.
+void interpolatePositions(float alpha) {
+    renderer.interpolated = renderer.saved && renderer.savedVersion == pointsVersion;
+    if (!renderer.interpolated) return;
+
+    const __m256 t = _mm256_set1_ps(alpha);
+    for (u32 i = 0; i < paddedAmount(); i += 8) {
+        __m256 x = _mm256_load_ps(&renderer.previousX[i]);
+        __m256 y = _mm256_load_ps(&renderer.previousY[i]);
+        x = _mm256_fmadd_ps(_mm256_sub_ps(loadPositionsX(i), x), t, x);
+        y = _mm256_fmadd_ps(_mm256_sub_ps(loadPositionsY(i), y), t, y);
+        _mm256_store_ps(&renderer.drawnX[i], x);
+        _mm256_store_ps(&renderer.drawnY[i], y);
+    }
+}
+
+float drawnPositionX(u32 p) { return renderer.interpolated ? renderer.drawnX[p] : getPositionX(p); }
+float drawnPositionY(u32 p) { return renderer.interpolated ? renderer.drawnY[p] : getPositionY(p); }
+__m256 loadDrawnX(u32 i) {
+    return renderer.interpolated ? _mm256_load_ps(&renderer.drawnX[i]) : loadPositionsX(i);
+}
+__m256 loadDrawnY(u32 i) {
+    return renderer.interpolated ? _mm256_load_ps(&renderer.drawnY[i]) : loadPositionsY(i);
+}
+
+// `visible` lists the particles to draw, or is 0 to draw the first `count` ones
+void drawTextures(const u32 *visible, u32 count) {
+    Texture2D circleTex = renderer.circle;
+    const Color *colors = renderer.palette;
+
+    Vector2 origin = {0, 0};
+    Rectangle src = {0, 0, circleTex.width, circleTex.height};
+    for (u32 k = 0; k < count; k++) {
+        u32 p = visible ? visible[k] : k;
+        float posX = drawnPositionX(p), posY = drawnPositionY(p), radius = getRadius(p);
+
+        Rectangle dest = {posX - radius, posY - radius, radius * 2, radius * 2};
+        DrawTexturePro(circleTex, src, dest, origin, 0, colors[pts.colors[p]]);
+    }
+}
+
+void uploadStream(int stream, const void *data, u32 size) {
+    rlUpdateVertexBuffer(renderer.streamVbos[stream], data, size, 0);
+}
+
+// Plain float arrays are used as they are when every particle is drawn, otherwise the streams
+// are gathered (or decoded) to a scratch copy in the frame arena. Lanes past `count` are
+// sentinels with no radius.
+RenderStreams renderStreams(const u32 *visible, u32 count) {
+#if !defined(HALF_STORAGE) && !defined(AOSOA_LAYOUT)
+    if (!visible && renderer.interpolated) {
+        return (RenderStreams){renderer.drawnX, renderer.drawnY, pts.radiuses, pts.colors};
+    }
+    if (!visible) return (RenderStreams){pts.positionsX, pts.positionsY, pts.radiuses, pts.colors};
+#endif
+
+    u32 padded = (count + 7) & ~7u;
+    RenderStreams streams = {
+        (float *)alloc(renderArena, 32, padded * sizeof(float)),
+        (float *)alloc(renderArena, 32, padded * sizeof(float)),
+        (float *)alloc(renderArena, 32, padded * sizeof(float)),
+        (u8 *)alloc(renderArena, 32, padded),
+    };
+
+    if (!visible) {
+        for (u32 i = 0; i < padded; i += 8) {
+            _mm256_store_ps(&streams.positionsX[i], loadDrawnX(i));
+            _mm256_store_ps(&streams.positionsY[i], loadDrawnY(i));
+            _mm256_store_ps(&streams.radiuses[i], loadRadiuses(i));
+        }
+        memcpy(streams.colors, pts.colors, padded);
+        return streams;
+    }
+
+    for (u32 k = 0; k < count; k++) {
+        u32 p = visible[k];
+        streams.positionsX[k] = drawnPositionX(p), streams.positionsY[k] = drawnPositionY(p);
+        streams.radiuses[k] = getRadius(p), streams.colors[k] = pts.colors[p];
+    }
+    for (u32 k = count; k < padded; k++) {
+        streams.positionsX[k] = streams.positionsY[k] = streams.radiuses[k] = 0;
+        streams.colors[k] = 0;
+    }
+    return streams;
+}
+
+void uploadInstances(const u32 *visible, u32 count) {
+    reserveInstances(pts.capacity);
+
+    RenderStreams streams = renderStreams(visible, count);
+    uploadStream(STREAM_POSITIONS_X, streams.positionsX, count * sizeof(float));
+    uploadStream(STREAM_POSITIONS_Y, streams.positionsY, count * sizeof(float));
+    uploadStream(STREAM_RADIUSES, streams.radiuses, count * sizeof(float));
+    uploadStream(STREAM_COLORS, streams.colors, count * sizeof(u8));
+}
+
+// Vertices of one corner of the quads of 8 particles, each 128 bit lane holds one particle:
+// x y uv color | ...
+void transposeCorner(__m256 x, __m256 y, __m256 uv, __m256 color, __m256 out[4]) {
+    __m256 xyLow = _mm256_unpacklo_ps(x, y), xyHigh = _mm256_unpackhi_ps(x, y);
+    __m256 uvLow = _mm256_unpacklo_ps(uv, color), uvHigh = _mm256_unpackhi_ps(uv, color);
+    out[0] = _mm256_shuffle_ps(xyLow, uvLow, 0x44);  // particles 0 and 4
+    out[1] = _mm256_shuffle_ps(xyLow, uvLow, 0xee);  // 1 and 5
+    out[2] = _mm256_shuffle_ps(xyHigh, uvHigh, 0x44); // 2 and 6
+    out[3] = _mm256_shuffle_ps(xyHigh, uvHigh, 0xee); // 3 and 7
+}
+
+// Stores the vertices `first` and `first + 1` of the quads of 8 particles, given as transposed
+// corners
+void storeCornerPair(QuadVertex *quads, u32 first, __m256 a[4], __m256 b[4]) {
+    for (int j = 0; j < 4; j++) {
+        _mm256_storeu_ps((float *)&quads[j * QUAD_VERTICES + first],
+                         _mm256_permute2f128_ps(a[j], b[j], 0x20));
+        _mm256_storeu_ps((float *)&quads[(j + 4) * QUAD_VERTICES + first],
+                         _mm256_permute2f128_ps(a[j], b[j], 0x31));
+    }
+}
+
+// Turns the streams into 6 vertices per particle, 8 particles at a time: corners from the
+// positions and radiuses, colors looked up in the palette with a gather
+void buildQuads(RenderStreams streams, u32 count, QuadVertex *quads) {
+    _Alignas(32) u32 palette[PALETTE_SIZE];
+    memcpy(palette, renderer.palette, sizeof(palette));
+
+    // u | v << 8 of the four corners
+    const __m256 uv00 = _mm256_castsi256_ps(_mm256_set1_epi32(0x0000));
+    const __m256 uv01 = _mm256_castsi256_ps(_mm256_set1_epi32(0xff00));
+    const __m256 uv11 = _mm256_castsi256_ps(_mm256_set1_epi32(0xffff));
+    const __m256 uv10 = _mm256_castsi256_ps(_mm256_set1_epi32(0x00ff));
+
+    for (u32 i = 0; i < count; i += 8) {
+        __m256 x = _mm256_load_ps(&streams.positionsX[i]);
+        __m256 y = _mm256_load_ps(&streams.positionsY[i]);
+        __m256 r = _mm256_load_ps(&streams.radiuses[i]);
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)&streams.colors[i]));
+        __m256 color = _mm256_castsi256_ps(_mm256_i32gather_epi32((int *)palette, index, 4));
+
+        __m256 x0 = _mm256_sub_ps(x, r), x1 = _mm256_add_ps(x, r);
+        __m256 y0 = _mm256_sub_ps(y, r), y1 = _mm256_add_ps(y, r);
+
+        __m256 topLeft[4], bottomLeft[4], bottomRight[4], topRight[4];
+        transposeCorner(x0, y0, uv00, color, topLeft);
+        transposeCorner(x0, y1, uv01, color, bottomLeft);
+        transposeCorner(x1, y1, uv11, color, bottomRight);
+        transposeCorner(x1, y0, uv10, color, topRight);
+
+        // Same order as quadCorners
+        QuadVertex *out = &quads[i * QUAD_VERTICES];
+        storeCornerPair(out, 0, topLeft, bottomLeft);
+        storeCornerPair(out, 2, bottomRight, topLeft);
+        storeCornerPair(out, 4, bottomRight, topRight);
+    }
+}
+
+// Starts drawing with one of our shaders. Whatever raylib batched so far has to be drawn first,
+// the camera is already set up by BeginMode2D() in the current modelview matrix.
+void beginCircleShader(CircleShader *circle) {
+    rlDrawRenderBatchActive();
+    Matrix mvp = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+
+    int textureSlot = 0;
+    rlEnableShader(circle->shader.id);
+    rlSetUniformMatrix(circle->mvpLoc, mvp);
+    rlSetUniform(circle->circleLoc, &textureSlot, RL_SHADER_UNIFORM_SAMPLER2D, 1);
+    rlActiveTextureSlot(textureSlot);
+    rlEnableTexture(renderer.circle.id);
+    rlEnableVertexArray(circle->vao);
+}
+
+void endCircleShader() {
+    rlDisableVertexArray();
+    rlDisableTexture();
+    rlDisableShader();
+}
+
+// Uploads `count` vertices to the batch and draws them in one call
+void drawQuadBatch(QuadBatch *batch, const QuadVertex *vertices, u32 count) {
+    rlUpdateVertexBuffer(batch->vbo, vertices, count * sizeof(QuadVertex), 0);
+
+    beginCircleShader(&batch->shader);
+    rlDrawVertexArray(0, count);
+    endCircleShader();
+}
+
+void drawQuads(const u32 *visible, u32 count) {
+    if (!count) return;
+    // Same capacity rule as the instance buffers, one quad per particle
+    reserveQuadBatch(&renderer.quads, pts.capacity * QUAD_VERTICES);
+
+    RenderStreams streams = renderStreams(visible, count);
+    u32 padded = (count + 7) & ~7u;
+    QuadVertex *quads =
+        (QuadVertex *)alloc(renderArena, 32, padded * QUAD_VERTICES * sizeof(QuadVertex));
+    buildQuads(streams, count, quads);
+    drawQuadBatch(&renderer.quads, quads, count * QUAD_VERTICES);
+}
+
+void drawInstanced(const u32 *visible, u32 count) {
+    if (!count) return;
+    uploadInstances(visible, count);
+
+    Vector4 palette[PALETTE_SIZE];
+    for (int c = 0; c < PALETTE_SIZE; c++) palette[c] = ColorNormalize(renderer.palette[c]);
+
+    beginCircleShader(&renderer.instanced);
+    rlSetUniform(renderer.paletteLoc, palette, RL_SHADER_UNIFORM_VEC4, PALETTE_SIZE);
+    rlDrawVertexArrayInstanced(0, QUAD_VERTICES, count);
+    endCircleShader();
+}
+
+// World pass, called between BeginMode2D() and EndMode2D(). Only the particles in the cells the
+// camera sees are drawn, or only the density of the cells when zoomed out. Returns how many
+// particles were drawn.
+u32 drawParticles(Camera2D camera) {
+    // Particles removed after the interpolation
+    if (renderer.savedVersion != pointsVersion) renderer.interpolated = false;
+    if (renderer.lod && camera.zoom < DENSITY_LOD_ZOOM && drawDensity()) return 0;
+
+    ArenaMark mark = getMark(renderArena);
+    u32 count = pts.amount, *visible = visiblePoints(camera, &count);
+
+    switch (renderer.mode) {
+    case RENDER_INSTANCED: drawInstanced(visible, count); break;
+    case RENDER_QUADS: drawQuads(visible, count); break;
+    default: drawTextures(visible, count); break;
+    }
+    restoreMark(renderArena, mark);
+    return count;
+}
+
+void closeRenderer() {
+    if (renderer.density.id) UnloadTexture(renderer.density);
+    unloadQuadBatch(&renderer.quads);
+    if (renderer.instanced.vao) {
+        for (int s = 0; renderer.capacity && s < INSTANCE_STREAMS; s++) {
+            rlUnloadVertexBuffer(renderer.streamVbos[s]);
+        }
+        rlUnloadVertexBuffer(renderer.cornersVbo);
+        unloadCircleShader(&renderer.instanced);
+    }
+    renderer = (Renderer){0};
+}
@@ -5,115 +5,148 @@
 #include <stdlib.h>
 
 #include "./include/globals.h"
+#include "./include/jobs.h"
+#include "./include/numa.h"
+#include "./include/points.h"
 
 #include "./include/sim.h"
 #include "./include/types.h"
 
-void updatePartitions() {
-    Partition *parts_ptr = &parts[0][0];
-    for (int i = 0; i < SPACE_PARTITIONS * SPACE_PARTITIONS; i++) {
-        int x = i / SPACE_PARTITIONS;
-        int y = i % SPACE_PARTITIONS;
-        parts_ptr[x * SPACE_PARTITIONS + y].amount = 0;
+// A full cell chains a spill chunk right after itself, so the chunk after the head is always the
+// one being filled
+void addToPartition(Partition *part, u32 p, u32 thread) {
+    if (unlikely(part->amount == PARTITION_CHUNK_POINTS)) {
+        Partition *spill = part->next;
+        if (!spill || spill->amount == PARTITION_CHUNK_POINTS) {
+            spill = (Partition *)poolAlloc(spillPool, thread);
+            spill->amount = 0;
+            spill->next = part->next;
+            part->next = spill;
+        }
+        part = spill;
+    }
+    part->points[part->amount++] = p;
+}
+
+void clearPartition(Partition *part, u32 thread) {
+    for (Partition *spill = part->next, *next; spill; spill = next) {
+        next = spill->next;
+        poolFree(spillPool, thread, spill);
     }
+    part->amount = 0;
+    part->next = 0;
+}
+
+u32 partitionAmount(Partition *part) {
+    u32 amount = 0;
+    for (; part; part = part->next) amount += part->amount;
+    return amount;
+}
 
-    int i = 0;
-    for (; i < pts.amount; i += 8) {
-        __m256 posX = _mm256_load_ps(&pts.positionsX[i]);
-        __m256 posY = _mm256_load_ps(&pts.positionsY[i]);
+void clearPartitions() {
+    Partition *parts_ptr = &parts[0][0];
+    partitionsValid = false;
+    for (int i = 0; i < SPACE_PARTITIONS * SPACE_PARTITIONS; i++) clearPartition(&parts_ptr[i], 0);
+}
 
-        __m256i x = _mm256_cvtps_epi32(_mm256_div_ps(posX, _mm256_set1_ps(PARTITION_SIZE)));
-        __m256i y = _mm256_cvtps_epi32(_mm256_div_ps(posY, _mm256_set1_ps(PARTITION_SIZE)));
+void updatePartitions() {
+    Partition *parts_ptr = &parts[0][0];
+    clearPartitions();
 
-        x = _mm256_abs_epi32(x);
-        y = _mm256_abs_epi32(y);
+    for (u32 i = 0; i < pts.amount; i += 8) {
+        __m256i x = loadColumns(i);
+        __m256i y = loadRows(i);
 
         _Alignas(32) int x_values[8];
         _Alignas(32) int y_values[8];
         _mm256_store_si256((__m256i *)x_values, x);
         _mm256_store_si256((__m256i *)y_values, y);
 
-        for (int j = 0; j < 8; j++) {
+        // Only the sentinels of the last vector are left out
+        u32 lanes = pts.amount - i < 8 ? pts.amount - i : 8;
+        for (u32 j = 0; j < lanes; j++) {
             int x_value = x_values[j];
             int y_value = y_values[j];
 
             int index = x_value * SPACE_PARTITIONS + y_value;
-            Partition *part = &parts_ptr[index];
-            part->points[part->amount++] = i + j;
+            addToPartition(&parts_ptr[index], i + j, 0);
         }
     }
-
-    for (; i < pts.amount; i++) {
-        int posX = (int)pts.positionsX[i];
-        int posY = (int)pts.positionsY[i];
-
-        int x = abs(posX / PARTITION_SIZE);
-        int y = abs(posY / PARTITION_SIZE);
-
-        Partition *part = &parts[x][y];
-        part->points[part->amount++] = i;
-    }
+    partitionsValid = true;
 }
 
-void updatePositions() {
-    if (pts.amount == 0) { return; }
+// First particle of the slice of the arrays that `thread` integrates. With NUMA placement the
+// slices follow the column ownership set up by placePoints(). Slices are whole vectors, the last
+// one ends with the sentinels.
+u32 pointsChunk(u32 thread) {
+    u32 padded = paddedAmount();
+    if (thread >= numThreads) return padded;
 
-    int i = 0;
+    u32 start = numaPlacement ? ownedPoints[thread] : (u64)pts.amount * thread / numThreads;
+    start &= ~7u;
+    return start < padded ? start : padded;
+}
 
-    for (; i <= pts.amount - 8; i += 8) {
-        __m256 positionsX = _mm256_load_ps(&pts.positionsX[i]);
-        __m256 positionsY = _mm256_load_ps(&pts.positionsY[i]);
+void integrateChunk(void *ctx, u32 index, u32 thread) {
+    u32 i = pointsChunk(index), end = pointsChunk(index + 1);
+    __m256 deltaT = _mm256_set1_ps(dt);
 
-        __m256 speedsX = _mm256_load_ps(&pts.speedsX[i]);
-        __m256 speedsY = _mm256_load_ps(&pts.speedsY[i]);
+    for (; i < end; i += 8) {
+        __m256 positionsX = loadPositionsX(i);
+        __m256 positionsY = loadPositionsY(i);
 
-        __m256 deltaT = _mm256_set1_ps(dt);
+        __m256 speedsX = loadSpeedsX(i);
+        __m256 speedsY = loadSpeedsY(i);
 
         positionsX = _mm256_add_ps(positionsX, _mm256_mul_ps(speedsX, deltaT));
         positionsY = _mm256_add_ps(positionsY, _mm256_mul_ps(speedsY, deltaT));
 
-        _mm256_store_ps(&pts.positionsX[i], positionsX);
-        _mm256_store_ps(&pts.positionsY[i], positionsY);
+        storePositionsX(i, positionsX);
+        storePositionsY(i, positionsY);
     }
+}
+
+void updatePositions() {
+    if (pts.amount == 0) { return; }
 
-    // remaining points
-    for (; i < pts.amount; i++) {
-        pts.positionsX[i] += pts.speedsX[i] * dt;
-        pts.positionsY[i] += pts.speedsY[i] * dt;
+    if (pinThreads) {
+        runJobsPerThread(integrateChunk, 0);
+    } else {
+        runJobs(integrateChunk, 0, numThreads);
     }
 }
 
 bool outOfBoundsX(u32 p) {
-    float posX = pts.positionsX[p];
-    float speedX = pts.speedsX[p];
-    float radius = pts.radiuses[p];
+    float posX = getPositionX(p);
+    float speedX = getSpeedX(p);
+    float radius = getRadius(p);
 
     float minX = -worldSize.x / 2 + radius, maxX = worldSize.x / 2 - radius;
     return (posX + radius >= maxX && speedX > 0) || (posX - radius <= minX && speedX < 0);
 }
 
 bool outOfBoundsY(u32 p) {
-    float posY = pts.positionsY[p];
-    float speedY = pts.speedsY[p];
-    float radius = pts.radiuses[p];
+    float posY = getPositionY(p);
+    float speedY = getSpeedY(p);
+    float radius = getRadius(p);
     float minY = -worldSize.y / 2 + radius, maxY = worldSize.y / 2 - radius;
 
     return (posY + radius >= maxY && speedY > 0) || (posY - radius <= minY && speedY < 0);
 }
 
 bool checkCollisions(u32 p1, u32 p2) {
-    float dx = pts.positionsX[p1] - pts.positionsX[p2];
-    float dy = pts.positionsY[p1] - pts.positionsY[p2];
+    float dx = getPositionX(p1) - getPositionX(p2);
+    float dy = getPositionY(p1) - getPositionY(p2);
     float distanceSquared = dx * dx + dy * dy;
-    float sum = pts.radiuses[p1] + pts.radiuses[p2];
+    float sum = getRadius(p1) + getRadius(p2);
     return distanceSquared <= sum * sum;
 }
 
 void resolveCollision(int p1, int p2) {
-    float dx = pts.positionsX[p1] - pts.positionsX[p2];
-    float dy = pts.positionsY[p1] - pts.positionsY[p2];
+    float dx = getPositionX(p1) - getPositionX(p2);
+    float dy = getPositionY(p1) - getPositionY(p2);
     float distanceSquared = dx * dx + dy * dy;
-    float sumRadii = pts.radiuses[p1] + pts.radiuses[p2];
+    float sumRadii = getRadius(p1) + getRadius(p2);
 
     if (distanceSquared > sumRadii * sumRadii) return;
 
@@ -122,55 +155,731 @@ void resolveCollision(int p1, int p2) {
     float nx = dx / sqrtDist;
     float ny = dy / sqrtDist;
 
-    float dvx = pts.speedsX[p1] - pts.speedsX[p2];
-    float dvy = pts.speedsY[p1] - pts.speedsY[p2];
+    float dvx = getSpeedX(p1) - getSpeedX(p2);
+    float dvy = getSpeedY(p1) - getSpeedY(p2);
 
     float dotProduct = dvx * nx + dvy * ny;
 
     if (dotProduct > 0) return;
 
-    pts.speedsX[p1] += -dotProduct * nx;
-    pts.speedsY[p1] += -dotProduct * ny;
-    pts.speedsX[p2] -= -dotProduct * nx;
-    pts.speedsY[p2] -= -dotProduct * ny;
+    setSpeedX(p1, getSpeedX(p1) + -dotProduct * nx);
+    setSpeedY(p1, getSpeedY(p1) + -dotProduct * ny);
+    setSpeedX(p2, getSpeedX(p2) - -dotProduct * nx);
+    setSpeedY(p2, getSpeedY(p2) - -dotProduct * ny);
 }
 
-void solveCollisions() {
-    // Check collisions
-    // instead of checking every single point against every other point
-    //
-    // we are checking every single point in a partition against all other
-    // points in that partition.
-    Partition *parts_ptr = &parts[0][0];
-    for (int i = 0; i < SPACE_PARTITIONS * SPACE_PARTITIONS; i++) {
-        int x = i / SPACE_PARTITIONS, y = i % SPACE_PARTITIONS;
-        Partition *part = &parts_ptr[x * SPACE_PARTITIONS + y];
-        for (u32 k = 0; k < part->amount; k++) {
-            u32 this = part->points[k];
+// Collides with every particle of a cell starting at index `from` of its chunk `other`
+void collideWith(u32 this, Partition *other, u32 from) {
+    for (; other; other = other->next, from = 0) {
+        for (u32 l = from; l < other->amount; l++) {
+            u32 that = other->points[l];
+            if (checkCollisions(this, that)) { resolveCollision(this, that); }
+        }
+    }
+}
+
+void collidePartition(int x, int y) {
+    // Each pair of neighbouring cells is visited once: a cell checks itself and the cells to its
+    // right and below, so the work for column x only ever touches columns x and x + 1.
+    Partition *part = &parts[x][y];
+    bool hasRight = x + 1 < partitionsX, hasUp = y > 0, hasDown = y + 1 < partitionsY;
+
+    for (Partition *chunk = part; chunk; chunk = chunk->next) {
+        for (u32 k = 0; k < chunk->amount; k++) {
+            u32 this = chunk->points[k];
 
             bool oob = false;
             if (outOfBoundsX(this)) {
                 oob = true;
-                pts.speedsX[this] = -pts.speedsX[this];
-                pts.positionsX[this] += pts.speedsX[this] * 0.08;
+                setSpeedX(this, -getSpeedX(this));
+                setPositionX(this, getPositionX(this) + getSpeedX(this) * 0.08);
             }
 
             if (outOfBoundsY(this)) {
                 oob = true;
-                pts.speedsY[this] = -pts.speedsY[this];
-                pts.positionsY[this] += pts.speedsY[this] * 0.08;
+                setSpeedY(this, -getSpeedY(this));
+                setPositionY(this, getPositionY(this) + getSpeedY(this) * 0.08);
             }
 
             if (oob) continue;
-            for (u32 l = k + 1; l < part->amount; l++) {
-                u32 other = part->points[l];
-                if (checkCollisions(this, other)) { resolveCollision(this, other); }
+            collideWith(this, chunk, k + 1);
+            if (hasDown) collideWith(this, &parts[x][y + 1], 0);
+            if (hasRight) {
+                if (hasUp) collideWith(this, &parts[x + 1][y - 1], 0);
+                collideWith(this, &parts[x + 1][y], 0);
+                if (hasDown) collideWith(this, &parts[x + 1][y + 1], 0);
+            }
+        }
+    }
+}
+
+typedef struct {
+    u32 stripes;
+    u32 color;
+} CollisionBatch;
+
+void stripeColumns(u32 stripe, u32 stripes, int *x0, int *x1) {
+    int columns = columnsEnd - columnsBegin;
+    *x0 = columnsBegin + stripe * columns / stripes;
+    *x1 = columnsBegin + (stripe + 1) * columns / stripes;
+}
+
+void collideColumns(int x0, int x1) {
+    for (int x = x0; x < x1; x++) {
+        for (int y = 0; y < partitionsY; y++) collidePartition(x, y);
+    }
+}
+
+void collideStripe(void *ctx, u32 index, u32 thread) {
+    CollisionBatch *batch = (CollisionBatch *)ctx;
+    int x0, x1;
+    stripeColumns(index * 2 + batch->color, batch->stripes, &x0, &x1);
+    collideColumns(x0, x1);
+}
+
+typedef struct {
+    float *impulsesX;
+    float *impulsesY;
+} JacobiBuffers;
+
+static JacobiBuffers jacobiBuffers;
+
+// Particles of a cell and its 8 neighbours, copied to SoA scratch and padded to a multiple of 8
+// with particles parked far away so that they never collide. The arrays come from the thread's
+// arena and grow with the most crowded neighbourhood seen.
+typedef struct {
+    float *positionsX;
+    float *positionsY;
+    float *speedsX;
+    float *speedsY;
+    float *radiuses;
+    i32 *points;
+    u32 amount;
+    u32 capacity;
+} Neighbourhood;
+
+void gatherNeighbourhood(Neighbourhood *hood, Arena *scratch, int x, int y) {
+    u32 needed = 8;
+    for (int nx = x - 1; nx <= x + 1; nx++) {
+        if (nx < 0 || nx >= partitionsX) continue;
+        for (int ny = y - 1; ny <= y + 1; ny++) {
+            if (ny >= 0 && ny < partitionsY) needed += partitionAmount(&parts[nx][ny]);
+        }
+    }
+
+    if (needed > hood->capacity) {
+        hood->capacity = needed > hood->capacity * 2 ? needed : hood->capacity * 2;
+        hood->positionsX = (float *)alloc(scratch, 32, hood->capacity * sizeof(float));
+        hood->positionsY = (float *)alloc(scratch, 32, hood->capacity * sizeof(float));
+        hood->speedsX = (float *)alloc(scratch, 32, hood->capacity * sizeof(float));
+        hood->speedsY = (float *)alloc(scratch, 32, hood->capacity * sizeof(float));
+        hood->radiuses = (float *)alloc(scratch, 32, hood->capacity * sizeof(float));
+        hood->points = (i32 *)alloc(scratch, 32, hood->capacity * sizeof(i32));
+    }
+
+    hood->amount = 0;
+    for (int nx = x - 1; nx <= x + 1; nx++) {
+        if (nx < 0 || nx >= partitionsX) continue;
+        for (int ny = y - 1; ny <= y + 1; ny++) {
+            if (ny < 0 || ny >= partitionsY) continue;
+
+            Partition *part = &parts[nx][ny];
+            for (; part; part = part->next) {
+                for (u32 k = 0; k < part->amount; k++) {
+                    u32 p = part->points[k], at = hood->amount++;
+                    hood->positionsX[at] = getPositionX(p);
+                    hood->positionsY[at] = getPositionY(p);
+                    hood->speedsX[at] = getSpeedX(p);
+                    hood->speedsY[at] = getSpeedY(p);
+                    hood->radiuses[at] = getRadius(p);
+                    hood->points[at] = p;
+                }
+            }
+        }
+    }
+
+    for (u32 at = hood->amount; at % 8; at++) {
+        hood->positionsX[at] = hood->positionsY[at] = 1e18f;
+        hood->speedsX[at] = hood->speedsY[at] = hood->radiuses[at] = 0;
+        hood->points[at] = -1;
+    }
+}
+
+// Same impulse as resolveCollision(), but only for the particle p and summed over every
+// neighbour at once. Only the previous speeds are read, so the order of the cells and of the
+// neighbours does not matter and no other particle is written.
+void accumulateImpulse(Neighbourhood *hood, u32 p) {
+    __m256 px = _mm256_set1_ps(getPositionX(p)), py = _mm256_set1_ps(getPositionY(p));
+    __m256 vx = _mm256_set1_ps(getSpeedX(p)), vy = _mm256_set1_ps(getSpeedY(p));
+    __m256 r = _mm256_set1_ps(getRadius(p));
+    __m256i self = _mm256_set1_epi32(p);
+    __m256 epsilon = _mm256_set1_ps(1e-5f), zero = _mm256_setzero_ps();
+
+    __m256 accX = zero, accY = zero;
+    for (u32 i = 0; i < hood->amount; i += 8) {
+        __m256 dx = _mm256_sub_ps(px, _mm256_load_ps(&hood->positionsX[i]));
+        __m256 dy = _mm256_sub_ps(py, _mm256_load_ps(&hood->positionsY[i]));
+        __m256 distanceSquared = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        __m256 sumRadii = _mm256_add_ps(r, _mm256_load_ps(&hood->radiuses[i]));
+
+        __m256 hit = _mm256_cmp_ps(distanceSquared, _mm256_mul_ps(sumRadii, sumRadii), _CMP_LE_OQ);
+        __m256i other = _mm256_load_si256((__m256i *)&hood->points[i]);
+        hit = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(other, self)), hit);
+        if (_mm256_testz_ps(hit, hit)) continue;
+
+        __m256 sqrtDist = _mm256_add_ps(_mm256_sqrt_ps(distanceSquared), epsilon);
+        __m256 nx = _mm256_div_ps(dx, sqrtDist), ny = _mm256_div_ps(dy, sqrtDist);
+
+        __m256 dvx = _mm256_sub_ps(vx, _mm256_load_ps(&hood->speedsX[i]));
+        __m256 dvy = _mm256_sub_ps(vy, _mm256_load_ps(&hood->speedsY[i]));
+        __m256 dotProduct = _mm256_add_ps(_mm256_mul_ps(dvx, nx), _mm256_mul_ps(dvy, ny));
+
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(dotProduct, zero, _CMP_LE_OQ));
+        __m256 impulse = _mm256_and_ps(_mm256_sub_ps(zero, dotProduct), hit);
+        accX = _mm256_add_ps(accX, _mm256_mul_ps(impulse, nx));
+        accY = _mm256_add_ps(accY, _mm256_mul_ps(impulse, ny));
+    }
+
+    _Alignas(32) float sumX[8], sumY[8];
+    _mm256_store_ps(sumX, accX);
+    _mm256_store_ps(sumY, accY);
+    float totalX = 0, totalY = 0;
+    for (int j = 0; j < 8; j++) totalX += sumX[j], totalY += sumY[j];
+
+    jacobiBuffers.impulsesX[p] = totalX;
+    jacobiBuffers.impulsesY[p] = totalY;
+}
+
+void accumulateColumn(void *ctx, u32 index, u32 thread) {
+    Arena *scratch = threadArenas[thread];
+    ArenaMark mark = getMark(scratch);
+    Neighbourhood hood = {0};
+
+    int x = columnsBegin + index;
+    for (int y = 0; y < partitionsY; y++) {
+        Partition *part = &parts[x][y];
+        if (!part->amount) continue;
+
+        gatherNeighbourhood(&hood, scratch, x, y);
+        for (; part; part = part->next) {
+            for (u32 k = 0; k < part->amount; k++) accumulateImpulse(&hood, part->points[k]);
+        }
+    }
+
+    restoreMark(scratch, mark);
+}
+
+// Applies the summed impulses, or bounces the particle off the walls like collidePartition()
+void applyImpulsesChunk(void *ctx, u32 index, u32 thread) {
+    u32 i = pointsChunk(index), end = pointsChunk(index + 1);
+
+    const __m256 halfW = _mm256_set1_ps(worldSize.x / 2), halfH = _mm256_set1_ps(worldSize.y / 2);
+    const __m256 zero = _mm256_setzero_ps(), nudge = _mm256_set1_ps(0.08f);
+    for (; i < end; i += 8) {
+        __m256 posX = loadPositionsX(i), posY = loadPositionsY(i);
+        __m256 speedX = loadSpeedsX(i), speedY = loadSpeedsY(i);
+        __m256 r = loadRadiuses(i), r2 = _mm256_add_ps(r, r);
+
+        // posX + r >= w / 2 - r && speedX > 0 || posX - r <= -w / 2 + r && speedX < 0
+        __m256 oobX = _mm256_or_ps(
+            _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(posX, r2), halfW, _CMP_GE_OQ),
+                          _mm256_cmp_ps(speedX, zero, _CMP_GT_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(_mm256_sub_ps(posX, r2), _mm256_sub_ps(zero, halfW),
+                                        _CMP_LE_OQ),
+                          _mm256_cmp_ps(speedX, zero, _CMP_LT_OQ)));
+        __m256 oobY = _mm256_or_ps(
+            _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(posY, r2), halfH, _CMP_GE_OQ),
+                          _mm256_cmp_ps(speedY, zero, _CMP_GT_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(_mm256_sub_ps(posY, r2), _mm256_sub_ps(zero, halfH),
+                                        _CMP_LE_OQ),
+                          _mm256_cmp_ps(speedY, zero, _CMP_LT_OQ)));
+        __m256 oob = _mm256_or_ps(oobX, oobY);
+
+        __m256 bouncedX = _mm256_blendv_ps(speedX, _mm256_sub_ps(zero, speedX), oobX);
+        __m256 bouncedY = _mm256_blendv_ps(speedY, _mm256_sub_ps(zero, speedY), oobY);
+        posX = _mm256_add_ps(posX, _mm256_and_ps(_mm256_mul_ps(bouncedX, nudge), oobX));
+        posY = _mm256_add_ps(posY, _mm256_and_ps(_mm256_mul_ps(bouncedY, nudge), oobY));
+
+        __m256 impulseX = _mm256_andnot_ps(oob, _mm256_load_ps(&jacobiBuffers.impulsesX[i]));
+        __m256 impulseY = _mm256_andnot_ps(oob, _mm256_load_ps(&jacobiBuffers.impulsesY[i]));
+
+        storeSpeedsX(i, _mm256_add_ps(bouncedX, impulseX));
+        storeSpeedsY(i, _mm256_add_ps(bouncedY, impulseY));
+        storePositionsX(i, posX);
+        storePositionsY(i, posY);
+    }
+}
+
+// Jacobi style solver: every particle sums the impulses of all its contacts from the speeds of the
+// previous step, then all of them are applied in one pass. There are no write conflicts, so
+// every column runs in parallel without coloring, and the result does not depend on the order
+// the columns are processed in.
+void solveCollisionsJacobi() {
+    // Sentinels have no contacts, their impulses stay 0
+    u32 padded = paddedAmount();
+    jacobiBuffers.impulsesX = (float *)alloc(frameArena, 32, padded * sizeof(float));
+    jacobiBuffers.impulsesY = (float *)alloc(frameArena, 32, padded * sizeof(float));
+    if (padded) {
+        _mm256_store_ps(&jacobiBuffers.impulsesX[padded - 8], _mm256_setzero_ps());
+        _mm256_store_ps(&jacobiBuffers.impulsesY[padded - 8], _mm256_setzero_ps());
+    }
+
+    runJobs(accumulateColumn, 0, columnsEnd - columnsBegin);
+    runJobs(applyImpulsesChunk, 0, numThreads);
+}
+
+u32 collisionStripes() {
+    u32 stripes = deterministic ? DETERMINISTIC_STRIPES
+                  : taskGraph   ? numThreads * GRAPH_STRIPES_PER_THREAD
+                                : numThreads * 2;
+    if (stripes > (u32)(columnsEnd - columnsBegin)) stripes = columnsEnd - columnsBegin;
+    stripes &= ~1u;
+    return stripes < 2 ? 2 : stripes;
+}
+
+// When threads are pinned every thread keeps the same run of stripe pairs (and so the same
+// columns of the grid) from one frame to the next, so its data can live on its own node.
+void ownedStripePairs(u32 thread, u32 stripes, u32 *first, u32 *last) {
+    *first = thread * (stripes / 2) / numThreads;
+    *last = (thread + 1) * (stripes / 2) / numThreads;
+}
+
+void ownedColumns(u32 thread, int *x0, int *x1) {
+    u32 stripes = collisionStripes(), first, last;
+    ownedStripePairs(thread, stripes, &first, &last);
+    stripeColumns(first * 2, stripes, x0, x1);
+    if (last > first) {
+        int end;
+        stripeColumns(last * 2 - 1, stripes, &end, x1);
+    } else {
+        *x1 = *x0;
+    }
+}
+
+void collideOwnedStripes(void *ctx, u32 index, u32 thread) {
+    CollisionBatch *batch = (CollisionBatch *)ctx;
+    u32 first, last;
+    ownedStripePairs(thread, batch->stripes, &first, &last);
+    for (u32 pair = first; pair < last; pair++) collideStripe(ctx, pair, thread);
+}
+
+void solveCollisions() {
+    // Check collisions
+    // instead of checking every single point against every other point
+    //
+    // we are checking every single point in a partition against all other
+    // points in that partition and its neighbours.
+    //
+    // The grid is cut into column stripes. A stripe writes to its own columns and to the first
+    // column of the next one, so stripes of the same color never share particles and each color
+    // can be solved in parallel. The stripe layout fixes the order in which contacts along the
+    // stripe borders get resolved: the fast mode sizes it by thread count, the deterministic one
+    // uses a fixed layout so results do not depend on how many threads there are.
+    if (jacobi) {
+        solveCollisionsJacobi();
+        return;
+    }
+
+    u32 stripes = collisionStripes();
+    CollisionBatch even = {stripes, 0}, odd = {stripes, 1};
+
+    if (pinThreads) {
+        runJobsPerThread(collideOwnedStripes, &even);
+        runJobsPerThread(collideOwnedStripes, &odd);
+    } else {
+        runJobs(collideStripe, &even, stripes / 2);
+        runJobs(collideStripe, &odd, stripes / 2);
+    }
+}
+
+// Sorts the particles by grid column so that the particles of each thread's columns sit in one
+// slice of the arrays, then binds every slice (and every thread's grid columns) to the node of
+// the thread that owns it. Particles drift between columns over time, so this is redone every
+// time points are generated.
+void placePoints() {
+    // Nothing to sort or bind yet, the arrays may not even exist
+    if (!pts.amount) {
+        memset(ownedPoints, 0, sizeof(ownedPoints));
+        return;
+    }
+
+    static u32 columnStart[SPACE_PARTITIONS + 1];
+    memset(columnStart, 0, sizeof(columnStart));
+    for (u32 i = 0; i < pts.amount; i++) columnStart[pointColumn(i) + 1]++;
+    for (int x = 0; x < partitionsX; x++) columnStart[x + 1] += columnStart[x];
+
+    ArenaMark mark = getMark(frameArena);
+    u32 *dest = (u32 *)alloc(frameArena, 32, pts.amount * sizeof(u32));
+    for (u32 i = 0; i < pts.amount; i++) dest[i] = columnStart[pointColumn(i)]++;
+
+#define X(type, name)                                                                              \
+    {                                                                                              \
+        u64 bytes = STREAM_LENGTH(type, pts.amount) * sizeof(type);                                \
+        type *sorted = (type *)alloc(frameArena, 32, bytes);                                       \
+        for (u32 i = 0; i < pts.amount; i++) copyPoint(sorted, dest[i], pts.name, i);              \
+        memcpy(pts.name, sorted, bytes);                                                           \
+    }
+    POINTS_STREAMS(X)
+#undef X
+    restoreMark(frameArena, mark);
+    padPoints();
+    pointsVersion++;
+
+    // columnStart[x] now holds the end of column x
+    for (u32 t = 0; t < numThreads; t++) {
+        int x0, x1;
+        ownedColumns(t, &x0, &x1);
+        ownedPoints[t] = x0 > 0 ? columnStart[x0 - 1] : 0;
+    }
+    ownedPoints[numThreads] = pts.amount;
+
+    for (u32 t = 0; t < numThreads; t++) {
+        u32 from = pointsChunk(t), count = pointsChunk(t + 1) - from;
+        int node = threadNodes[t];
+
+#define X(type, name)                                                                              \
+    bindToNode(&pts.name[from / POINTS_PER(type)], STREAM_LENGTH(type, count) * sizeof(type), node);
+        POINTS_STREAMS(X)
+#undef X
+
+        int x0, x1;
+        ownedColumns(t, &x0, &x1);
+        bindToNode(&parts[x0][0], (x1 - x0) * sizeof(parts[0]), node);
+    }
+}
+
+// Same as pagesOnNode() over a slice of every array, weighted by the bytes of each
+float pointsOnNode(u32 from, u32 count, int node) {
+    double local = 0, total = 0;
+#define X(type, name)                                                                              \
+    {                                                                                              \
+        u64 bytes = STREAM_LENGTH(type, count) * sizeof(type);                                     \
+        float fraction = pagesOnNode(&pts.name[from / POINTS_PER(type)], bytes, node);             \
+        if (fraction >= 0) local += fraction * bytes, total += bytes;                              \
+    }
+    POINTS_STREAMS(X)
+#undef X
+    return total ? local / total : -1;
+}
+
+void reportPlacement() {
+    printf("Placement of %u particles:\n", pts.amount);
+    for (u32 t = 0; t < numThreads; t++) {
+        u32 from = pointsChunk(t), count = pointsChunk(t + 1) - from;
+        int node = threadNodes[t], x0, x1;
+        ownedColumns(t, &x0, &x1);
+
+        float points = pointsOnNode(from, count, node);
+        float grid = pagesOnNode(&parts[x0][0], (x1 - x0) * sizeof(parts[0]), node);
+        printf(" - thread %u: cpu %d, node %d, columns %d-%d, particles %u-%u", t, threadCpus[t],
+               node, x0, x1 - 1, from, from + count);
+        if (points >= 0) printf(" (%.0f%% local)", points * 100);
+        if (grid >= 0) printf(", grid %.0f%% local", grid * 100);
+        printf("\n");
+    }
+}
+
+typedef struct {
+    u32 stripes;
+    u32 start[SPACE_PARTITIONS + 1];
+    u32 migrantCount[SPACE_PARTITIONS];
+    u32 *order;
+    u32 *migrants;
+} FrameGraph;
+
+static TaskGraph frameTasks;
+static FrameGraph frame;
+
+void collideStripeTask(void *ctx, u32 stripe, u32 thread) {
+    int x0, x1;
+    stripeColumns(stripe, frame.stripes, &x0, &x1);
+    collideColumns(x0, x1);
+}
+
+// Integrates the particles of a stripe and bins them again for the next step. Particles that
+// leave the stripe are parked in its migrant list, the cells they move to may still be in use.
+void integrateStripeTask(void *ctx, u32 stripe, u32 thread) {
+    int x0, x1;
+    stripeColumns(stripe, frame.stripes, &x0, &x1);
+
+    u32 *order = &frame.order[frame.start[stripe]], count = 0;
+    for (int x = x0; x < x1; x++) {
+        for (int y = 0; y < partitionsY; y++) {
+            for (Partition *chunk = &parts[x][y]; chunk; chunk = chunk->next) {
+                memcpy(&order[count], chunk->points, chunk->amount * sizeof(u32));
+                count += chunk->amount;
             }
+            clearPartition(&parts[x][y], thread);
+        }
+    }
+
+    u32 *migrants = &frame.migrants[frame.start[stripe]], migrantCount = 0;
+    for (u32 k = 0; k < count; k++) {
+        u32 p = order[k];
+        setPositionX(p, getPositionX(p) + getSpeedX(p) * dt);
+        setPositionY(p, getPositionY(p) + getSpeedY(p) * dt);
+
+        int x = pointColumn(p);
+        if (x < x0 || x >= x1) {
+            migrants[migrantCount++] = p;
+            continue;
+        }
+
+        addToPartition(&parts[x][pointRow(p)], p, thread);
+    }
+
+    frame.migrantCount[stripe] = migrantCount;
+}
+
+// The whole step as a graph of per-stripe tasks instead of three full passes with a barrier
+// between each. Collisions of a stripe wait for its neighbours of the other color, integrating
+// (and binning) a stripe only waits for the collisions that write to its particles:
+//
+//   collide(s - 1) -> collide(s) <- collide(s + 1)      (s odd)
+//   collide(s - 1) -> integrate(s) <- collide(s)
+//
+// so the first stripes already integrate while later ones are still colliding. The grid left
+// behind is the one for the next step, updatePartitions() only runs when it is marked dirty.
+void runFrameGraph() {
+    u32 stripes = collisionStripes();
+    frame.order = (u32 *)alloc(frameArena, 32, pts.amount * sizeof(u32));
+    frame.migrants = (u32 *)alloc(frameArena, 32, pts.amount * sizeof(u32));
+
+    frame.stripes = stripes;
+    frame.start[0] = 0;
+    for (u32 s = 0; s < stripes; s++) {
+        int x0, x1;
+        stripeColumns(s, stripes, &x0, &x1);
+
+        u32 count = 0;
+        for (int x = x0; x < x1; x++) {
+            for (int y = 0; y < partitionsY; y++) count += partitionAmount(&parts[x][y]);
+        }
+        frame.start[s + 1] = frame.start[s] + count;
+    }
+
+    clearTaskGraph(&frameTasks);
+    for (u32 s = 0; s < stripes; s++) addTask(&frameTasks, collideStripeTask, 0, s);
+    for (u32 s = 0; s < stripes; s++) addTask(&frameTasks, integrateStripeTask, 0, s);
+
+    for (u32 s = 0; s < stripes; s++) {
+        u32 collide = s, integrate = stripes + s;
+        if (s % 2) {
+            addDependency(&frameTasks, collide - 1, collide);
+            if (s + 1 < stripes) addDependency(&frameTasks, collide + 1, collide);
+        }
+        addDependency(&frameTasks, collide, integrate);
+        if (s > 0) addDependency(&frameTasks, collide - 1, integrate);
+    }
+
+    runTaskGraph(&frameTasks);
+
+    for (u32 s = 0; s < stripes; s++) {
+        u32 *migrants = &frame.migrants[frame.start[s]];
+        for (u32 k = 0; k < frame.migrantCount[s]; k++) {
+            u32 p = migrants[k];
+            addToPartition(&parts[pointColumn(p)][pointRow(p)], p, 0);
+        }
+    }
+    partitionsValid = true;
+}
+
+void reportSpills() {
+    PoolStats stats = getPoolStats(spillPool);
+    printf(" - Spill chunks: %lu live, %lu allocs, %lu frees, %u slabs, %lu slabs returned\n",
+           stats.live, stats.allocs, stats.frees, stats.slabs, stats.slabsReturned);
+}
+
+// First marked slot in [from, to), or `to`
+u32 nextMarked(const u8 *marked, u32 from, u32 to) {
+    const __m256i zero = _mm256_setzero_si256();
+    for (; from + 32 <= to; from += 32) {
+        __m256i kept = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)&marked[from]), zero);
+        u32 bits = ~(u32)_mm256_movemask_epi8(kept);
+        if (bits) return from + __builtin_ctz(bits);
+    }
+    for (; from < to; from++) {
+        if (marked[from]) return from;
+    }
+    return to;
+}
+
+// One past the last unmarked slot in [from, to), or `from` if they are all marked
+u32 lastKept(const u8 *marked, u32 from, u32 to) {
+    const __m256i zero = _mm256_setzero_si256();
+    for (; to >= from + 32; to -= 32) {
+        __m256i kept = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)&marked[to - 32]), zero);
+        u32 bits = _mm256_movemask_epi8(kept);
+        if (bits) return to - __builtin_clz(bits);
+    }
+    for (; to > from; to--) {
+        if (!marked[to - 1]) return to;
+    }
+    return from;
+}
+
+// Chunk and slot of particle p in its cell, the grid is binned from the current positions
+bool findInPartition(u32 p, Partition **chunk, u32 *slot) {
+    for (Partition *at = &parts[pointColumn(p)][pointRow(p)]; at; at = at->next) {
+        for (u32 k = 0; k < at->amount; k++) {
+            if (at->points[k] != p) continue;
+            *chunk = at, *slot = k;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Takes p out of its cell, filling the hole with the last particle of the cell
+bool dropFromPartition(u32 p) {
+    Partition *chunk;
+    u32 slot;
+    if (!findInPartition(p, &chunk, &slot)) return false;
+
+    Partition *part = &parts[pointColumn(p)][pointRow(p)];
+    Partition *last = part->next ? part->next : part;
+    chunk->points[slot] = last->points[--last->amount];
+
+    if (last != part && !last->amount) {
+        part->next = last->next;
+        poolFree(spillPool, 0, last);
+    }
+    return true;
+}
+
+// Removes every particle whose byte in `marked` is set. Holes are filled with the last surviving
+// particles, so only as many particles move as are removed: the moves are listed first with a
+// SIMD scan of the marks, then applied one array at a time. A grid kept from the last step is
+// patched in place instead of being binned again.
+u32 compactPoints(const u8 *marked) {
+    bool patchGrid = !partitionsDirty;
+    ArenaMark mark = getMark(frameArena);
+
+    u32 removed = 0;
+    for (u32 p = nextMarked(marked, 0, pts.amount); p < pts.amount;
+         p = nextMarked(marked, p + 1, pts.amount)) {
+        removed++;
+        if (patchGrid && !dropFromPartition(p)) patchGrid = false, partitionsDirty = true;
+    }
+    if (!removed) return 0;
+
+    u32 *moveFrom = (u32 *)alloc(frameArena, 32, removed * sizeof(u32));
+    u32 *moveTo = (u32 *)alloc(frameArena, 32, removed * sizeof(u32));
+    u32 moves = 0, lo = 0, hi = pts.amount;
+    for (;;) {
+        lo = nextMarked(marked, lo, hi);
+        if (lo == hi) break;
+        hi = lastKept(marked, lo, hi);
+        if (hi == lo) break;
+
+        moveFrom[moves] = --hi;
+        moveTo[moves++] = lo++;
+    }
+
+#define X(type, name)                                                                              \
+    for (u32 m = 0; m < moves; m++) copyPoint(pts.name, moveTo[m], pts.name, moveFrom[m]);
+    POINTS_STREAMS(X)
+#undef X
+
+    for (u32 m = 0; patchGrid && m < moves; m++) {
+        Partition *chunk;
+        u32 slot;
+        if (findInPartition(moveFrom[m], &chunk, &slot)) chunk->points[slot] = moveTo[m];
+        else partitionsDirty = true, patchGrid = false;
+    }
+
+    pts.amount = lo;
+    padPoints();
+    pointsVersion++;
+    if (!patchGrid) partitionsValid = false;
+    restoreMark(frameArena, mark);
+    return removed;
+}
+
+u64 hashPoints() {
+    // FNV-1a (per word) over the simulated state, used to compare runs bit for bit
+    u64 hash = 0xcbf29ce484222325;
+    float (*streams[])(u32) = {getPositionX, getPositionY, getSpeedX, getSpeedY};
+    for (int s = 0; s < 4; s++) {
+        for (u32 i = 0; i < pts.amount; i++) {
+            float value = streams[s](i);
+            u32 word;
+            memcpy(&word, &value, sizeof(word));
+            hash = (hash ^ word) * 0x100000001b3;
         }
     }
+    return hash;
+}
+
+float halfPositionError(float position, float half, int cells) {
+    u8 cell;
+    u16 offset;
+    encodePosition(position, half, cells, &cell, &offset);
+    return fabsf(decodePosition(cell, offset, half) - position);
+}
+
+// Relative, down to the smallest normal fp16 below which the error stays the same in absolute
+float halfSpeedError(float speed) {
+    float half = _cvtsh_ss(_cvtss_sh(speed, _MM_FROUND_TO_NEAREST_INT));
+    return fabsf(half - speed) / fmaxf(fabsf(speed), 0x1p-14f);
+}
+
+// Without HALF_STORAGE: the worst error storing this step's state in half precision would add,
+// measured by encoding every position and speed. With it: the bounds of that error.
+void reportHalfError() {
+#ifdef HALF_STORAGE
+    // Half a step of rounding the offset, plus rounding the decoded position to a float
+    float half = fmaxf(worldSize.x, worldSize.y) / 2, rounding = nextafterf(half, INFINITY) - half;
+    printf(" - Half storage error: positions <= %.5f, speeds <= %.3f%%\n",
+           offsetStep() / 2 + rounding / 2, 100.0f / 2048);
+#else
+    float position = 0, speed = 0;
+    for (u32 p = 0; p < pts.amount; p++) {
+        float errorX = halfPositionError(getPositionX(p), worldSize.x / 2, partitionsX);
+        float errorY = halfPositionError(getPositionY(p), worldSize.y / 2, partitionsY);
+        position = fmaxf(position, fmaxf(errorX, errorY));
+        speed = fmaxf(speed, fmaxf(halfSpeedError(getSpeedX(p)), halfSpeedError(getSpeedY(p))));
+    }
+    printf(" - Half storage error: positions %.5f, speeds %.3f%%\n", position, speed * 100);
+#endif
+}
+
+// Flips to the other frame arena and clears it, along with the per-thread ones. Whatever the
+// previous step allocated stays valid until the step after this one.
+void beginFrame() {
+    frameArena = frameArenas[++frameIndex & 1];
+    resetArena(frameArena);
+    for (u32 t = 0; t < numThreads; t++) resetArena(threadArenas[t]);
+
+    // No step is running, hand the spill slabs emptied since the last trim back
+    if (frameIndex % SPILL_TRIM_FRAMES == 0) trimPool(spillPool, frameArena);
 }
 
 void updateParticles() {
+    beginFrame();
+
+    if (taskGraph && !jacobi) {
+        double start = GetTime();
+        if (partitionsDirty) updatePartitions();
+        partitionsDirty = false;
+        runFrameGraph();
+        double end = GetTime();
+
+        if (!stepReports) return;
+
+        u32 migrants = 0;
+        for (u32 s = 0; s < frame.stripes; s++) migrants += frame.migrantCount[s];
+
+        printf("Updated %u particles in %.2fms:\n"
+               " - Task graph: %u stripes, %u tasks, %u migrants\n",
+               pts.amount, (end - start) * 1000, frame.stripes, frameTasks.count, migrants);
+
+        if (deterministic) printf(" - State hash: %016lx\n", hashPoints());
+        if (halfError) reportHalfError();
+        reportSpills();
+        return;
+    }
+
     double start = GetTime();
     updatePartitions();
     double endParts = GetTime();
@@ -178,6 +887,7 @@ void updateParticles() {
     double endColls = GetTime();
     updatePositions();
     double end = GetTime();
+    if (!stepReports) return;
 
     double totalMS = (end - start) * 1000;
     double totalParts = (endParts - start) * 1000;
@@ -189,4 +899,188 @@ void updateParticles() {
            " - Collisions: %.2fms\n"
            " - Positions: %.2fms\n",
            pts.amount, totalMS, totalParts, totalColls, totalPos);
+
+    if (deterministic) printf(" - State hash: %016lx\n", hashPoints());
+    if (halfError) reportHalfError();
+    reportSpills();
+}
+
+// Removal goes through a byte per particle, padded so the SIMD scans can read whole vectors
+u8 *newRemovalMarks() {
+    u8 *marked = alloc(frameArena, 32, pts.amount + 32);
+    memset(marked, 0, pts.amount + 32);
+    return marked;
+}
+
+u32 removePointsAt(const u32 *indices, u32 count) {
+    ArenaMark mark = getMark(frameArena);
+    u8 *marked = newRemovalMarks();
+    for (u32 i = 0; i < count; i++) {
+        if (indices[i] < pts.amount) marked[indices[i]] = 1;
+    }
+
+    u32 removed = compactPoints(marked);
+    restoreMark(frameArena, mark);
+    return removed;
+}
+
+u32 removePointsIf(bool (*predicate)(u32 p, void *ctx), void *ctx) {
+    ArenaMark mark = getMark(frameArena);
+    u8 *marked = newRemovalMarks();
+    for (u32 p = 0; p < pts.amount; p++) marked[p] = predicate(p, ctx);
+
+    u32 removed = compactPoints(marked);
+    restoreMark(frameArena, mark);
+    return removed;
+}
+
+u32 removePointsInRect(Rectangle region) {
+    ArenaMark mark = getMark(frameArena);
+    u8 *marked = newRemovalMarks();
+
+    const __m256 minX = _mm256_set1_ps(region.x), maxX = _mm256_set1_ps(region.x + region.width);
+    const __m256 minY = _mm256_set1_ps(region.y), maxY = _mm256_set1_ps(region.y + region.height);
+    // Marks of the sentinels are past the end, compactPoints() never looks at them
+    for (u32 i = 0; i < pts.amount; i += 8) {
+        __m256 x = loadPositionsX(i), y = loadPositionsY(i);
+        __m256 inside = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(x, minX, _CMP_GE_OQ), _mm256_cmp_ps(x, maxX, _CMP_LT_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(y, minY, _CMP_GE_OQ), _mm256_cmp_ps(y, maxY, _CMP_LT_OQ)));
+
+        // One bit per lane spread to one byte per lane
+        u64 bits = _mm256_movemask_ps(inside);
+        u64 bytes = _pdep_u64(bits, 0x0101010101010101);
+        memcpy(&marked[i], &bytes, 8);
+    }
+
+    u32 removed = compactPoints(marked);
+    restoreMark(frameArena, mark);
+    return removed;
+}
+
+#define STREAM_BYTES(type, capacity)                                                               \
+    ((STREAM_LENGTH(type, (u64)(capacity)) * sizeof(type) + 31) & ~31ull)
+
+// Makes room for at least `needed` particles. Capacity doubles, and all the arrays are moved
+// together to a new block of the arena, each one still 32 byte aligned for the AVX loads. It is a
+// multiple of 8, so there is always room for the sentinels after the last particle.
+void reservePoints(u32 needed) {
+    if (likely(needed <= pts.capacity)) return;
+
+    u32 capacity = pts.capacity ? pts.capacity : POINTS_ADDED;
+    while (capacity < needed) capacity *= 2;
+
+    u64 size = 0;
+#define X(type, name) size += STREAM_BYTES(type, capacity);
+    POINTS_STREAMS(X)
+#undef X
+
+    u8 *block = alloc(particleArena, 32, size), *at = block;
+#define X(type, name)                                                                              \
+    if (pts.amount) memcpy(at, pts.name, STREAM_LENGTH(type, paddedAmount()) * sizeof(type));      \
+    pts.name = (type *)at;                                                                         \
+    at += STREAM_BYTES(type, capacity);
+    POINTS_STREAMS(X)
+#undef X
+
+    if (pts.block) releaseArenaRange(particleArena, pts.block, pts.blockSize);
+    pts.block = block;
+    pts.blockSize = size;
+    pts.capacity = capacity;
+}
+
+void clearPoints() {
+    resetArena(particleArena);
+    pts = (Points){0};
+    pointsVersion++;
+    partitionsDirty = true;
+    clearPartitions();
+}
+
+void spawnPoints(u32 count) {
+    reservePoints(pts.amount + count);
+
+    const int end = pts.amount + count;
+    for (int i = pts.amount; i < end; ++i) {
+        u8 r = BASE_SIZE + GetRandomValue(3, 4);
+
+        setPositionX(i, GetRandomValue(-worldSize.x / 2 + r, worldSize.x / 2 - r));
+        setPositionY(i, GetRandomValue(-worldSize.y / 2 + r, worldSize.y / 2 - r));
+
+        setSpeedX(i, GetRandomValue(-MAX_SPEED, MAX_SPEED));
+        setSpeedY(i, GetRandomValue(-MAX_SPEED, MAX_SPEED));
+
+        setRadius(i, r);
+        pts.colors[i] = GetRandomValue(0, PALETTE_SIZE - 1);
+    }
+
+    pts.amount += count;
+    padPoints();
+    pointsVersion++;
+
+    partitionsDirty = true;
+    partitionsValid = false;
+    if (numaPlacement) placePoints();
+    if (numaReport) reportPlacement();
+}
+
+void generatePoints() { spawnPoints(POINTS_ADDED); }
+
+// Command line options of the simulation itself, shared by every entry point. Returns false when
+// argv[*i] is not one of them, otherwise consumes it (and its value).
+bool parseSimArg(int argc, char **argv, int *i) {
+    const char *arg = argv[*i];
+    bool value = *i + 1 < argc;
+    if (!strcmp(arg, "--threads") && value) {
+        numThreads = atoi(argv[++*i]);
+    } else if (!strcmp(arg, "--deterministic")) {
+        deterministic = true;
+    } else if (!strcmp(arg, "--task-graph")) {
+        taskGraph = true;
+    } else if (!strcmp(arg, "--jacobi")) {
+        jacobi = true;
+    } else if (!strcmp(arg, "--half-error")) {
+        halfError = true;
+    } else if (!strcmp(arg, "--particles") && value) {
+        initialPoints = atoi(argv[++*i]);
+    } else if (!strcmp(arg, "--pin")) {
+        pinThreads = true;
+    } else if (!strcmp(arg, "--numa")) {
+        pinThreads = numaPlacement = true;
+    } else if (!strcmp(arg, "--numa-report")) {
+        pinThreads = numaReport = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Arenas, pools and grid dimensions, once the options are parsed
+void initSimulation() {
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > MAX_THREADS) numThreads = MAX_THREADS;
+
+    // Only reserves address space, pages get committed as the arrays grow into them
+    particleArena = NewVirtualArena(GB(4), true, TAG_PARTICLES);
+    frameArenas[0] = NewVirtualArena(GB(1), false, TAG_SCRATCH);
+    frameArenas[1] = NewVirtualArena(GB(1), false, TAG_SCRATCH);
+    bool threadArenasFailed = false;
+    for (u32 t = 0; t < numThreads; t++) {
+        threadArenas[t] = NewVirtualArena(MB(256), false, TAG_SCRATCH);
+        threadArenasFailed |= !threadArenas[t];
+    }
+    renderArena = NewVirtualArena(GB(1), false, TAG_RENDER);
+    frameArena = frameArenas[0];
+    spillPool = NewPool(sizeof(Partition), SPILL_SLAB_CHUNKS, TAG_GRID);
+    trackStaticMemory(TAG_GRID, sizeof(parts));
+    if (!particleArena || !frameArenas[0] || !frameArenas[1] || threadArenasFailed ||
+        !renderArena || !spillPool) {
+        printf("Failed to init the arenas\n");
+        crash();
+    }
+
+    PARTITION_SIZE = worldSize.x / SPACE_PARTITIONS;
+    partitionsX = worldSize.x / PARTITION_SIZE;
+    partitionsY = worldSize.y / PARTITION_SIZE;
+    columnsBegin = 0, columnsEnd = partitionsX;
 }
@@ -0,0 +1,185 @@
+#include <immintrin.h>
+#include <stdio.h>
+
+#include "raylib.h"
+#include "rlgl.h"
+
+#include "./include/globals.h"
+#include "./include/memory.h"
+#include "./include/points.h"
+#include "./include/render.h"
+#include "./include/trails.h"
+#include "./include/types.h"
+
+// Last positions of every particle, one sample per step. A sample is a u16 stream of x and one
+// of y for every particle, like the streams of Points, and the samples follow each other
+// `capacity` particles apart in a ring, so a step only writes one contiguous row of each.
+// Positions are quantized over the world, 1/65535 of its size.
+struct {
+    u32 samples;  // length of the trails, 0 when disabled
+    u32 capacity; // particles a sample has room for
+    u32 head;     // sample written last
+    u32 filled;   // samples recorded since the particles last changed
+    u32 version;  // pointsVersion the samples were recorded at
+    u16 *x, *y;   // [sample * capacity + particle]
+    Arena *arena;
+    QuadBatch batch;
+    double drawSeconds; // building and submitting the last frame's trails
+} typedef Trails;
+
+static Trails trails;
+
+void setTrailSamples(u32 samples) {
+    trails.samples = samples < 2 ? 0 : samples > TRAIL_MAX_SAMPLES ? TRAIL_MAX_SAMPLES : samples;
+}
+
+// The segments are drawn with the quad shader, so it needs the window. Trails are turned off when
+// the shader does not compile.
+void initTrails() {
+    if (!trails.samples || loadQuadBatch(&trails.batch)) return;
+    printf("Trails need GL 3.3, drawing none\n");
+    trails.samples = 0;
+}
+
+void closeTrails() { unloadQuadBatch(&trails.batch); }
+
+// Samples follow the capacity of Points, the history is dropped when it grows
+void reserveTrails() {
+    if (!trails.arena) trails.arena = NewVirtualArena(GB(1), false, TAG_RENDER);
+    resetArena(trails.arena);
+
+    u64 bytes = (u64)trails.samples * pts.capacity * sizeof(u16);
+    trails.x = (u16 *)alloc(trails.arena, 32, bytes);
+    trails.y = (u16 *)alloc(trails.arena, 32, bytes);
+    trails.capacity = pts.capacity;
+    trails.filled = 0;
+}
+
+// 8 positions to u16, clamped to the world
+void storeQuantized(u16 *out, __m256 positions, __m256 scale, __m256 shift) {
+    __m256 q = _mm256_fmadd_ps(positions, scale, shift);
+    q = _mm256_min_ps(_mm256_max_ps(q, _mm256_setzero_ps()), _mm256_set1_ps(65535));
+    __m256i words = _mm256_cvtps_epi32(q);
+    __m128i packed =
+        _mm_packus_epi32(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+    _mm_store_si128((__m128i *)out, packed);
+}
+
+// Records the positions of the step that just ran as the newest sample
+void updateTrails() {
+    if (!trails.samples) return;
+    double start = GetTime();
+
+    if (trails.capacity < pts.capacity) reserveTrails();
+    if (trails.version != pointsVersion) trails.filled = 0, trails.version = pointsVersion;
+
+    trails.head = (trails.head + 1) % trails.samples;
+    u16 *x = &trails.x[(u64)trails.head * trails.capacity];
+    u16 *y = &trails.y[(u64)trails.head * trails.capacity];
+
+    const __m256 scaleX = _mm256_set1_ps(65535 / worldSize.x);
+    const __m256 scaleY = _mm256_set1_ps(65535 / worldSize.y);
+    const __m256 shift = _mm256_set1_ps(65535 / 2.0f);
+    for (u32 i = 0; i < paddedAmount(); i += 8) {
+        storeQuantized(&x[i], loadPositionsX(i), scaleX, shift);
+        storeQuantized(&y[i], loadPositionsY(i), scaleY, shift);
+    }
+    if (trails.filled < trails.samples) trails.filled++;
+
+    if (!stepReports) return;
+    printf(" - Trails: %.2fms (%.2fms drawing the last frame), %u of %u samples, %.1fMB\n",
+           (GetTime() - start) * 1000, trails.drawSeconds * 1000, trails.filled, trails.samples,
+           2.0 * trails.samples * trails.capacity * sizeof(u16) / MB(1));
+}
+
+// The segments of 8 particles from a to b as the quads of buildQuads(), each corner moved
+// `halfWidth` off an end across the segment. The UVs all point at the middle of the circle
+// texture, where it is opaque.
+void buildSegments(__m256 ax, __m256 ay, __m256 bx, __m256 by, __m256 halfWidth, __m256 color,
+                   QuadVertex *out) {
+    __m256 dx = _mm256_sub_ps(bx, ax), dy = _mm256_sub_ps(by, ay);
+    __m256 length = _mm256_sqrt_ps(_mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy)));
+    // Segments of a particle that did not move have no width
+    __m256 moved = _mm256_cmp_ps(length, _mm256_setzero_ps(), _CMP_GT_OQ);
+    __m256 scale = _mm256_and_ps(_mm256_div_ps(halfWidth, length), moved);
+    __m256 nx = _mm256_mul_ps(_mm256_sub_ps(_mm256_setzero_ps(), dy), scale);
+    __m256 ny = _mm256_mul_ps(dx, scale);
+
+    const __m256 uv = _mm256_castsi256_ps(_mm256_set1_epi32(0x8080));
+    __m256 aLeft[4], aRight[4], bLeft[4], bRight[4];
+    transposeCorner(_mm256_add_ps(ax, nx), _mm256_add_ps(ay, ny), uv, color, aLeft);
+    transposeCorner(_mm256_sub_ps(ax, nx), _mm256_sub_ps(ay, ny), uv, color, aRight);
+    transposeCorner(_mm256_sub_ps(bx, nx), _mm256_sub_ps(by, ny), uv, color, bRight);
+    transposeCorner(_mm256_add_ps(bx, nx), _mm256_add_ps(by, ny), uv, color, bLeft);
+
+    storeCornerPair(out, 0, aLeft, aRight);
+    storeCornerPair(out, 2, bRight, aLeft);
+    storeCornerPair(out, 4, bRight, bLeft);
+}
+
+// Position of a particle in a sample, back to world coordinates
+Vector2 trailPoint(u32 sample, u32 p) {
+    u64 at = (u64)sample * trails.capacity + p;
+    return (Vector2){trails.x[at] * (worldSize.x / 65535) - worldSize.x / 2,
+                     trails.y[at] * (worldSize.y / 65535) - worldSize.y / 2};
+}
+
+// Under the world pass: every visible particle's trail, from where its sprite is drawn through
+// its older samples, fading out, in the color of the particle. The segments are one pixel wide
+// quads built 8 particles at a time into one vertex buffer and drawn in a single call. They are
+// built one sample at a time so that only two rows of the ring are read at once, and oldest
+// first so newer segments blend over them.
+void drawTrails(Camera2D camera) {
+    if (!trails.samples || trails.filled < 2 || trails.version != pointsVersion) return;
+    if (renderer.lod && camera.zoom < DENSITY_LOD_ZOOM) return;
+
+    double start = GetTime();
+    ArenaMark mark = getMark(renderArena);
+    u32 count = pts.amount, *visible = visiblePoints(camera, &count);
+
+    // The last vector of a sample spills over the start of the next one, and of the buffer
+    u32 segments = trails.filled - 1;
+    u32 vertices = count * segments * QUAD_VERTICES;
+    u64 bytes = ((u64)vertices + 8 * QUAD_VERTICES) * sizeof(QuadVertex);
+    QuadVertex *quads = (QuadVertex *)alloc(renderArena, 32, bytes);
+
+    const __m256 halfWidth = _mm256_set1_ps(0.5f / camera.zoom);
+    for (u32 s = segments; s > 0; s--) {
+        u32 older = (trails.head + trails.samples - s) % trails.samples;
+        u32 newer = (older + 1) % trails.samples;
+        u32 alpha = 255 * (trails.filled - s) / trails.filled;
+        QuadVertex *out = &quads[(u64)(segments - s) * count * QUAD_VERTICES];
+
+        for (u32 k = 0; k < count; k += 8) {
+            _Alignas(32) float ax[8], ay[8], bx[8], by[8];
+            _Alignas(32) u32 colors[8];
+            for (u32 j = 0; j < 8; j++) {
+                u32 last = k + j < count ? k + j : count - 1;
+                u32 p = visible ? visible[last] : last;
+
+                // The newest sample is ahead of the sprite while it is interpolated, it is left out
+                Vector2 a = s == 1 ? (Vector2){drawnPositionX(p), drawnPositionY(p)}
+                                   : trailPoint(newer, p);
+                Vector2 b = trailPoint(older, p);
+                ax[j] = a.x, ay[j] = a.y, bx[j] = b.x, by[j] = b.y;
+
+                Color color = renderer.palette[pts.colors[p]];
+                colors[j] = color.r | color.g << 8 | color.b << 16 | alpha << 24;
+            }
+
+            buildSegments(_mm256_load_ps(ax), _mm256_load_ps(ay), _mm256_load_ps(bx),
+                          _mm256_load_ps(by), halfWidth, _mm256_load_ps((float *)colors),
+                          &out[k * QUAD_VERTICES]);
+        }
+    }
+
+    // The visible segments change from frame to frame, the buffer grows by at least twice
+    if (vertices > trails.batch.capacity) {
+        u32 grown = trails.batch.capacity * 2;
+        reserveQuadBatch(&trails.batch, vertices > grown ? vertices : grown);
+    }
+    if (vertices) drawQuadBatch(&trails.batch, quads, vertices);
+
+    restoreMark(renderArena, mark);
+    trails.drawSeconds = GetTime() - start;
+}